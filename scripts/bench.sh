@@ -0,0 +1,246 @@
+#!/bin/bash
+#
+# Benchmark harness for the multicast file distribution protocol.
+#
+# Builds a private network out of namespaces: a hub namespace holding a bridge,
+# one namespace for the server and one per client, each joined to the bridge by
+# a veth pair. netem is applied to the hub side of every client's veth so each
+# receiver sees independent loss, delay and reordering. With LANES above 1 every
+# namespace gets one veth per lane on its own bridge and subnet, and the server
+# and clients are run with -i so each lane is sent over its own interface.
+#
+# For every profile, file size and receiver count a transfer is run and one row
+# is appended to the CSV with throughput, repair overhead and completion times,
+# taken from the JSON metrics written by the server and clients (-m json:).
+#
+# Must be run as root. Settings are taken from the environment:
+#   SIZES      file sizes passed to head -c            (default "1M 16M 64M")
+#   RECEIVERS  receiver counts                         (default "1 2 4")
+#   PROFILES   netem profiles, see profile_args below  (default "clean loss1 loss5 delay reorder")
+#   REPEAT     runs per combination                    (default 1)
+#   OUT        CSV file to append to                   (default bench/results.csv)
+#   TIMEOUT    seconds before a run is killed          (default 300)
+#   LANES      interfaces per namespace                (default 1)
+#   LANE_MODE  stripe or mirror when LANES > 1         (default stripe)
+#   SERVER_ARGS / CLIENT_ARGS  extra options for the binaries, to compare protocol modes
+#
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SERVER="$ROOT/out/server"
+CLIENT="$ROOT/out/client"
+
+SIZES=${SIZES:-"1M 16M 64M"}
+RECEIVERS=${RECEIVERS:-"1 2 4"}
+PROFILES=${PROFILES:-"clean loss1 loss5 delay reorder"}
+REPEAT=${REPEAT:-1}
+OUT=${OUT:-"$ROOT/bench/results.csv"}
+TIMEOUT=${TIMEOUT:-300}
+LANES=${LANES:-1}
+LANE_MODE=${LANE_MODE:-stripe}
+SERVER_ARGS=${SERVER_ARGS:-""}
+CLIENT_ARGS=${CLIENT_ARGS:-""}
+
+PREFIX=mfd
+SUBNET=10.77
+SERVER_IP=$SUBNET.0.1
+PORT=18239
+HUB=$PREFIX-hub
+
+WORK=$(mktemp -d /tmp/mfd-bench.XXXXXX)
+MAX_RECEIVERS=0
+NETEM=1
+
+# netem arguments for each profile, empty means no qdisc
+profile_args()
+{
+    case "$1" in
+        clean)   echo "" ;;
+        loss1)   echo "loss 1%" ;;
+        loss5)   echo "loss 5%" ;;
+        delay)   echo "delay 5ms 1ms" ;;
+        reorder) echo "delay 2ms reorder 10% 50%" ;;
+        *)       echo "Unknown profile '$1'" >&2; exit 1 ;;
+    esac
+}
+
+cleanup()
+{
+    for ns in $(ip netns list | awk '{print $1}' | grep "^$PREFIX-"); do
+        ip netns pids "$ns" | xargs -r kill 2>/dev/null
+        ip netns del "$ns"
+    done
+    rm -rf "/etc/netns/$PREFIX-srv" "$WORK"
+}
+
+# Joins namespace $1 to every lane bridge with host address $2, hub side named $3-<lane>
+attach()
+{
+    ip netns add "$1"
+    ip -n "$1" link set lo up
+    for lane in $(seq 0 $((LANES - 1))); do
+        ip link add "$3-$lane" netns "$HUB" type veth peer name "eth$lane" netns "$1"
+        ip -n "$HUB" link set "$3-$lane" master "br$lane" up
+        ip -n "$1" addr add "$SUBNET.$lane.$2/24" dev "eth$lane"
+        ip -n "$1" link set "eth$lane" up
+    done
+    ip -n "$1" route add 224.0.0.0/4 dev eth0
+}
+
+setup_network()
+{
+    ip netns add "$HUB"
+    for lane in $(seq 0 $((LANES - 1))); do
+        ip -n "$HUB" link add "br$lane" type bridge
+        # There is no querier on the bridge so snooping would drop the group
+        ip -n "$HUB" link set "br$lane" type bridge mcast_snooping 0
+        ip -n "$HUB" link set "br$lane" up
+    done
+
+    attach "$PREFIX-srv" 1 srv
+    for i in $(seq 1 "$MAX_RECEIVERS"); do
+        attach "$PREFIX-c$i" $((i + 10)) "c$i"
+    done
+
+    # The server binds to the address from 'hostname -i', so resolve it to the veth
+    mkdir -p "/etc/netns/$PREFIX-srv"
+    echo "$SERVER_IP $(hostname)" > "/etc/netns/$PREFIX-srv/hosts"
+
+    if ! ip netns exec "$HUB" tc qdisc add dev c1-0 root netem delay 0ms 2>/dev/null; then
+        echo "netem is not available, only the clean profile will be run" >&2
+        NETEM=0
+    fi
+    ip netns exec "$HUB" tc qdisc del dev c1-0 root 2>/dev/null
+}
+
+apply_profile()
+{
+    local args
+    args=$(profile_args "$1")
+    for i in $(seq 1 "$MAX_RECEIVERS"); do
+        for lane in $(seq 0 $((LANES - 1))); do
+            ip netns exec "$HUB" tc qdisc del dev "c$i-$lane" root 2>/dev/null
+            if [ -n "$args" ]; then
+                ip netns exec "$HUB" tc qdisc add dev "c$i-$lane" root netem $args
+            fi
+        done
+    done
+}
+
+# Reads an integer field from the summary line of a JSON metrics file
+summary_field()
+{
+    grep '"event":"summary"' "$1" | grep -o "\"$2\":[0-9]*" | head -1 | cut -d: -f2
+}
+
+# Runs one transfer and prints a CSV row
+run_once()
+{
+    local profile=$1 size=$2 receivers=$3 run=$4 port=$5
+    local dir="$WORK/run"
+    rm -rf "$dir"
+    mkdir -p "$dir"
+
+    head -c "$size" /dev/urandom > "$dir/source.bin"
+    local bytes
+    bytes=$(stat -c %s "$dir/source.bin")
+
+    ip netns exec "$PREFIX-srv" timeout "$TIMEOUT" "$SERVER" "$receivers" "$dir/source.bin" "$port" \
+        -m "json:$dir/server.json" $SERVER_ARGS > "$dir/server.log" 2>&1 &
+    local server_pid=$!
+    sleep 0.5
+
+    local pids=()
+    for i in $(seq 1 "$receivers"); do
+        mkdir -p "$dir/c$i"
+        ip netns exec "$PREFIX-c$i" timeout "$TIMEOUT" "$CLIENT" "$SERVER_IP" "$dir/c$i/" "$port" \
+            -m "json:$dir/c$i.json" $CLIENT_ARGS > "$dir/c$i.log" 2>&1 &
+        pids+=($!)
+    done
+
+    local ok=1
+    for pid in "${pids[@]}"; do
+        wait "$pid" || ok=0
+    done
+    wait "$server_pid" || ok=0
+
+    for i in $(seq 1 "$receivers"); do
+        cmp -s "$dir/source.bin" "$dir/c$i/source.bin" || ok=0
+    done
+
+    if [ $ok -eq 0 ] || [ ! -s "$dir/server.json" ]; then
+        echo "$profile,$size,$bytes,$receivers,$run,0,,,,,,,"
+        cp -r "$dir" "$(dirname "$OUT")/failed-$profile-$size-$receivers-$run" 2>/dev/null
+        return
+    fi
+
+    local elapsed packets resent rounds
+    elapsed=$(summary_field "$dir/server.json" elapsed_us)
+    packets=$(summary_field "$dir/server.json" packets)
+    resent=$(summary_field "$dir/server.json" packets_resent)
+    rounds=$(summary_field "$dir/server.json" repair_rounds)
+
+    # Client completion times, sorted for the median and tail
+    local times
+    times=$(for i in $(seq 1 "$receivers"); do summary_field "$dir/c$i.json" elapsed_us; done | sort -n)
+    local p50 max
+    p50=$(echo "$times" | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }')
+    max=$(echo "$times" | tail -1)
+
+    awk -v p="$profile" -v s="$size" -v b="$bytes" -v r="$receivers" -v n="$run" \
+        -v e="$elapsed" -v pk="$packets" -v rs="$resent" -v rr="$rounds" -v p50="$p50" -v mx="$max" \
+        'BEGIN { printf "%s,%s,%d,%d,%d,1,%d,%.2f,%d,%d,%.4f,%d,%d\n",
+                 p, s, b, r, n, e, (e > 0) ? b / e : 0, pk, rs, (pk > 0) ? rs / pk : 0, p50, mx }'
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "bench.sh needs root to create network namespaces" >&2
+    exit 1
+fi
+
+if [ ! -x "$SERVER" ] || [ ! -x "$CLIENT" ]; then
+    echo "Build the server and client with 'make' first" >&2
+    exit 1
+fi
+
+for r in $RECEIVERS; do
+    MAX_RECEIVERS=$(( r > MAX_RECEIVERS ? r : MAX_RECEIVERS ))
+done
+
+if [ "$LANES" -gt 1 ]; then
+    INTERFACES=$(seq -s, -f "eth%g" 0 $((LANES - 1)))
+    SERVER_ARGS="$SERVER_ARGS -i $INTERFACES"
+    CLIENT_ARGS="$CLIENT_ARGS -i $INTERFACES"
+    if [ "$LANE_MODE" = "mirror" ]; then
+        SERVER_ARGS="$SERVER_ARGS -M"
+    fi
+fi
+
+trap cleanup EXIT
+cleanup
+mkdir -p "$WORK"
+setup_network
+
+mkdir -p "$(dirname "$OUT")"
+if [ ! -s "$OUT" ]; then
+    echo "profile,size,bytes,receivers,run,ok,server_us,mb_per_sec,packets,packets_resent,repair_overhead,client_p50_us,client_max_us" > "$OUT"
+fi
+
+for profile in $PROFILES; do
+    if [ $NETEM -eq 0 ] && [ -n "$(profile_args "$profile")" ]; then
+        continue
+    fi
+    apply_profile "$profile"
+
+    for size in $SIZES; do
+        for receivers in $RECEIVERS; do
+            for run in $(seq 1 "$REPEAT"); do
+                # A fresh port per run as the last server's socket may still be in TIME_WAIT
+                PORT=$((PORT + 1))
+                row=$(run_once "$profile" "$size" "$receivers" "$run" "$PORT")
+                echo "$row" | tee -a "$OUT"
+            done
+        done
+    done
+done
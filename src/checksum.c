@@ -0,0 +1,242 @@
+#include "header.h"
+#include "checksum.h"
+#include "trace.h"
+
+/* Number of checksums read at a time when folding the cache into the file checksum */
+#define FOLD_CHUNK 1024
+
+/**
+  * Offset of the checksum for 'window_number' in the cache file.
+  */
+static off_t cache_offset(int64_t window_number)
+{
+    return sizeof(checksum_cache_header) + window_number * sizeof(uint32_t);
+}
+
+/**
+  * Fills in the cache header fields that identify the source file.
+  */
+static void fill_cache_header(checksum_table* table, checksum_cache_header* header)
+{
+    memset(header, 0, sizeof(checksum_cache_header));
+    memcpy(header->magic, CHECKSUM_CACHE_MAGIC, sizeof(header->magic));
+    header->inode = table->file_stat.st_ino;
+    header->size = table->file_stat.st_size;
+    header->mtime_sec = table->file_stat.st_mtim.tv_sec;
+    header->mtime_nsec = table->file_stat.st_mtim.tv_nsec;
+    header->window_bytes = WINDOW_SIZE * BUFFER_SIZE;
+    header->window_count = table->window_count;
+}
+
+/**
+  * Returns 1 and leaves table->cache_fd open if the sidecar cache matches the source file.
+  */
+static int load_cache(checksum_table* table)
+{
+    int cache_fd = open(table->cache_path, O_RDONLY);
+    if (cache_fd < 0)
+    {
+        return 0;
+    }
+
+    checksum_cache_header header, expected;
+    struct stat cache_stat;
+    fill_cache_header(table, &expected);
+
+    int valid = read(cache_fd, &header, sizeof(header)) == sizeof(header)
+        && fstat(cache_fd, &cache_stat) == 0
+        && cache_stat.st_size == cache_offset(table->window_count);
+
+    /* Everything apart from the file checksum has to match */
+    expected.file_checksum = header.file_checksum;
+    if (!valid || memcmp(&header, &expected, sizeof(header)) != 0)
+    {
+        close(cache_fd);
+        return 0;
+    }
+
+    table->cache_fd = cache_fd;
+    table->file_checksum = header.file_checksum;
+    return 1;
+}
+
+/**
+  * Called once every window has been written to the temporary cache.
+  * Folds the window checksums into the file checksum and renames the cache into place.
+  * Failing to write the cache (for example a read-only directory) is not an error.
+  */
+static void save_cache(checksum_table* table)
+{
+    uint32_t chunk[FOLD_CHUNK];
+    int file_checksum = 0;
+    int ok = !__atomic_load_n(&table->cache_failed, __ATOMIC_RELAXED);
+
+    for (int64_t i = 0; ok && i<table->window_count; i += FOLD_CHUNK)
+    {
+        int count = MIN(FOLD_CHUNK, table->window_count - i);
+        size_t len = count * sizeof(uint32_t);
+        ok = pread(table->cache_fd, chunk, len, cache_offset(i)) == (ssize_t) len;
+
+        for (int j = 0; ok && j<count; j++)
+        {
+            file_checksum = fold_checksum(file_checksum, chunk[j]);
+        }
+    }
+
+    checksum_cache_header header;
+    fill_cache_header(table, &header);
+    header.file_checksum = file_checksum;
+
+    ok = ok && pwrite(table->cache_fd, &header, sizeof(header), 0) == sizeof(header);
+    if (!ok || rename(table->tmp_path, table->cache_path) < 0)
+    {
+        unlink(table->tmp_path);
+    }
+}
+
+/**
+  * Worker thread, takes windows in order until none are left.
+  * Workers never run more than CHECKSUM_AHEAD windows ahead of the oldest window still needed.
+  * The last worker to finish saves the cache.
+  */
+static void* checksum_worker(void* arg)
+{
+    checksum_table* table = arg;
+    off_t filesize = table->file_stat.st_size;
+
+    while (1)
+    {
+        int64_t window_number = __atomic_fetch_add(&table->next_window, 1, __ATOMIC_RELAXED);
+        if (window_number >= table->window_count)
+        {
+            break;
+        }
+
+        pthread_mutex_lock(&table->lock);
+        while (window_number >= table->oldest_needed + CHECKSUM_AHEAD)
+        {
+            pthread_cond_wait(&table->window_released, &table->lock);
+        }
+        pthread_mutex_unlock(&table->lock);
+
+        off_t stop_offset = MIN(WINDOW_OFFSET(window_number + 1), filesize);
+        TRACE(TRACE_CHECKSUM_START, window_number, 0);
+        uint32_t checksum = get_checksum(table->fd, WINDOW_OFFSET(window_number), stop_offset);
+        TRACE(TRACE_CHECKSUM_END, window_number, 0);
+
+        if (table->cache_fd >= 0
+            && pwrite(table->cache_fd, &checksum, sizeof(checksum), cache_offset(window_number)) != sizeof(checksum))
+        {
+            __atomic_store_n(&table->cache_failed, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&table->lock);
+        table->checksums[window_number % CHECKSUM_AHEAD] = checksum;
+        table->slot_window[window_number % CHECKSUM_AHEAD] = window_number;
+        int all_done = (++table->windows_done == table->window_count);
+        pthread_cond_broadcast(&table->window_done);
+        pthread_mutex_unlock(&table->lock);
+
+        if (all_done && table->cache_fd >= 0)
+        {
+            save_cache(table);
+        }
+    }
+
+    return NULL;
+}
+
+void checksum_table_open(checksum_table* table, int fd, const char* path, struct stat* file_stat, int num_threads)
+{
+    memset(table, 0, sizeof(checksum_table));
+    table->fd = fd;
+    table->file_stat = *file_stat;
+    table->cache_fd = -1;
+    snprintf(table->cache_path, PATH_MAX, "%s%s", path, CHECKSUM_CACHE_SUFFIX);
+    /* Per process so concurrent daemon sessions of the same file don't write over each other */
+    snprintf(table->tmp_path, sizeof(table->tmp_path), "%s.%d.tmp", table->cache_path, (int) getpid());
+
+    /* There is always a final window, which is empty if the file is a multiple of the window size */
+    table->window_count = file_stat->st_size / (WINDOW_SIZE * BUFFER_SIZE) + 1;
+    for (int i = 0; i<CHECKSUM_AHEAD; i++)
+    {
+        table->slot_window[i] = -1;
+    }
+
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->window_done, NULL);
+    pthread_cond_init(&table->window_released, NULL);
+
+    if (load_cache(table))
+    {
+        printf("Loaded window checksums from %s\n", table->cache_path);
+        table->from_cache = 1;
+        return;
+    }
+
+    /* Workers write each checksum straight into the cache so nothing grows with the file size */
+    table->cache_fd = open(table->tmp_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    table->num_threads = MAX(1, MIN(num_threads, table->window_count));
+    table->threads = calloc(table->num_threads, sizeof(pthread_t));
+    for (int i = 0; i<table->num_threads; i++)
+    {
+        if (pthread_create(&table->threads[i], NULL, checksum_worker, table) != 0)
+        {
+            perror("Failed to start checksum thread");
+            exit(-1);
+        }
+    }
+}
+
+int checksum_table_get(checksum_table* table, int64_t window_number)
+{
+    uint32_t checksum;
+
+    if (table->from_cache)
+    {
+        if (pread(table->cache_fd, &checksum, sizeof(checksum), cache_offset(window_number)) != sizeof(checksum))
+        {
+            perror("Failed to read checksum cache");
+            exit(-1);
+        }
+        return checksum;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    while (table->slot_window[window_number % CHECKSUM_AHEAD] != window_number)
+    {
+        pthread_cond_wait(&table->window_done, &table->lock);
+    }
+    checksum = table->checksums[window_number % CHECKSUM_AHEAD];
+    pthread_mutex_unlock(&table->lock);
+
+    return checksum;
+}
+
+void checksum_table_release(checksum_table* table, int64_t window_number)
+{
+    pthread_mutex_lock(&table->lock);
+    table->oldest_needed = MAX(table->oldest_needed, window_number);
+    pthread_cond_broadcast(&table->window_released);
+    pthread_mutex_unlock(&table->lock);
+}
+
+void checksum_table_close(checksum_table* table)
+{
+    /* Let any worker still waiting for room finish so the cache is complete */
+    checksum_table_release(table, table->window_count);
+    for (int i = 0; i<table->num_threads; i++)
+    {
+        pthread_join(table->threads[i], NULL);
+    }
+
+    if (table->cache_fd >= 0)
+    {
+        close(table->cache_fd);
+    }
+    pthread_mutex_destroy(&table->lock);
+    pthread_cond_destroy(&table->window_done);
+    pthread_cond_destroy(&table->window_released);
+    free(table->threads);
+}
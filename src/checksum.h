@@ -0,0 +1,99 @@
+#ifndef __MCAST_CHECKSUM_H
+#define __MCAST_CHECKSUM_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+/*
+ * Per-window checksums of the source file.
+ * Worker threads checksum windows in order while the server is already sending,
+ * and the result is saved to a sidecar cache file so repeat pushes of an unchanged
+ * file skip checksumming entirely.
+ */
+
+#define CHECKSUM_CACHE_MAGIC "MFDSUM02"
+#define CHECKSUM_CACHE_SUFFIX ".mfdsum"
+
+/*
+ * How many windows the workers may run ahead of the oldest window the server still needs.
+ * This bounds memory no matter how large the file is, 4096 windows is 8GB of the file.
+ */
+#define CHECKSUM_AHEAD 4096
+
+/*
+ * Sidecar cache layout: a checksum_cache_header followed by 'window_count' uint32_t checksums.
+ * The cache is only used if inode, size and mtime still match the source file.
+ */
+typedef struct checksum_cache_header
+{
+    char magic[8];
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t window_bytes;
+    int32_t file_checksum;
+    int64_t window_count;
+
+} checksum_cache_header;
+
+typedef struct checksum_table
+{
+    int fd;
+    struct stat file_stat;
+    char cache_path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+
+    /* Cache being read from, or being written by the workers, -1 if there is none */
+    int cache_fd;
+    int cache_failed;
+    int from_cache;
+    int file_checksum;
+
+    int64_t window_count;
+
+    /* Ring of the most recent checksums, slot_window records which window each slot holds */
+    uint32_t checksums[CHECKSUM_AHEAD];
+    int64_t slot_window[CHECKSUM_AHEAD];
+
+    /* Next window for a worker, oldest window still needed, and how many are finished */
+    int64_t next_window;
+    int64_t oldest_needed;
+    int64_t windows_done;
+
+    int num_threads;
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t window_done;
+    pthread_cond_t window_released;
+
+} checksum_table;
+
+
+/**
+  * Sets up 'table' for the file open on 'fd' at 'path'.
+  * If the sidecar cache is valid the checksums are read from it, otherwise
+  * 'num_threads' workers are started to compute them in the background.
+  */
+void checksum_table_open(checksum_table* table, int fd, const char* path, struct stat* file_stat, int num_threads);
+
+/**
+  * Returns the checksum of 'window_number', blocking until a worker has computed it.
+  * Only windows that have not been released can be asked for.
+  */
+int checksum_table_get(checksum_table* table, int64_t window_number);
+
+/**
+  * Tells the workers every window before 'window_number' is no longer needed,
+  * letting them reuse those slots to run further ahead.
+  */
+void checksum_table_release(checksum_table* table, int64_t window_number);
+
+/**
+  * Waits for the workers and frees the table.
+  */
+void checksum_table_close(checksum_table* table);
+
+#endif
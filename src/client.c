@@ -1,51 +1,106 @@
-#include "header.h"
+/* For F_SETPIPE_SZ, FALLOC_FL_PUNCH_HOLE and close_range */
+#define _GNU_SOURCE
 
-struct sockaddr_in m_address, tcp_address;
+#include "header.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rto.h"
+#include "peer.h"
+#include "seal.h"
+#include "stream.h"
+
+#include <stddef.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/* Largest number of words in a -R relay spec */
+#define MAX_RELAY_ARGS 32
+
+/* Descriptor the relay server reads verified windows from, every other one above stderr is closed */
+#define RELAY_PIPE_FD 3
+
+/* Results of receive_packet() */
+#define PACKET_CORRUPT 0
+#define PACKET_RECEIVED 1
+#define PACKET_STORED 2
+
+struct sockaddr_in m_address[MAX_LANES], tcp_address;
 struct ip_mreq mreq;
 
-int m_sd, tcp_sd; /* Socket descriptors */
+int m_sd[MAX_LANES], tcp_sd; /* Socket descriptors */
+
+/* Interfaces given with -i, lanes are joined on them in turn, with none the kernel picks */
+struct in_addr interfaces[MAX_LANES];
+int num_interfaces = 0, lanes = 1;
 
 /* Keeps track of the largest socket descriptor for select() */
 int highest_sd = 0; 
 
+/* Timeout before resending a NACK, adapted to how long the server takes to repair */
+rto_estimator nack_rto;
+
+/* Set by the server, receivers ask each other for repairs before NACKing the server */
+peer_state peers;
+int peer_repair = 0;
+
+/* Opens data packets when the server seals them, see seal.h */
+seal_state seal;
 
-void setup_client_multicast_socket()
+/* With -z the destination file is mapped and packet bodies are received straight into it */
+char* file_map = NULL;
+int64_t file_size = 0;
+
+/* Passes the verified prefix of the file on to a consumer during the transfer (-s, -N) */
+stream_state stream;
+int streaming = 0;
+
+/* Pipe to the downstream server when relaying, and its process */
+int relay_fd = -1;
+pid_t relay_pid = 0;
+
+
+void setup_client_multicast_socket(int lane, const char* group)
 {
     u_int yes = 1;
 
     /* Create multicast socket */
-    if ((m_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((m_sd[lane] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
         perror("Failed to create client UDP socket");
         exit(-1);
     }
 
-    highest_sd = higher(m_sd, highest_sd);
+    highest_sd = higher(m_sd[lane], highest_sd);
 
     /* Set socket options to reuse same port */
-    if (setsockopt(m_sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
+    if (setsockopt(m_sd[lane], SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
     {
         perror("Failed to reuse port address");
         exit(-1);
     }
 
     /* Create address to bind to socket */
-    memset(&m_address, 0, sizeof(m_address));
-    m_address.sin_family = AF_INET;
-    m_address.sin_addr.s_addr = inet_addr(MULTICAST_GROUP);
-    m_address.sin_port = MULTICAST_PORT;
+    memset(&m_address[lane], 0, sizeof(struct sockaddr_in));
+    m_address[lane].sin_family = AF_INET;
+    m_address[lane].sin_addr.s_addr = inet_addr(group);
+    m_address[lane].sin_port = MULTICAST_PORT + lane;
 
     /* Binding address to socket */
-    if (bind(m_sd, (struct sockaddr*)&m_address, sizeof(m_address)) < 0)
+    if (bind(m_sd[lane], (struct sockaddr*)&m_address[lane], sizeof(struct sockaddr_in)) < 0)
     {
         perror("Failed to bind socket to address");
         exit(-1);
     }
 
-    /* Set multicast group */
-    mreq.imr_multiaddr.s_addr = inet_addr(MULTICAST_GROUP);
+    /* Set multicast group on the lane's interface */
+    mreq.imr_multiaddr.s_addr = inet_addr(group);
     mreq.imr_interface.s_addr = INADDR_ANY;
-    if (setsockopt(m_sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    if (num_interfaces > 0)
+    {
+        mreq.imr_interface = interfaces[lane % num_interfaces];
+    }
+    if (setsockopt(m_sd[lane], IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
     {
         perror("Failed to add to multicast group\n");
         exit(-1);
@@ -69,6 +124,10 @@ void setup_client_tcp_socket(char* ip, int port)
     tcp_address.sin_addr.s_addr = inet_addr(ip);
     tcp_address.sin_port = port;
 
+    /* Control messages are small and latency sensitive, so don't let Nagle hold them back */
+    int yes = 1;
+    setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
     /* Connect to server's TCP socket */
     if (connect(tcp_sd, (struct sockaddr*) &tcp_address, sizeof(tcp_address)) < 0)
     {
@@ -84,7 +143,7 @@ void setup_client_tcp_socket(char* ip, int port)
   */
 void get_msg(void* buf, int len, int sd, struct sockaddr_in address)
 {
-    socklen_t addrlen;
+    socklen_t addrlen = sizeof(address);
     if (recvfrom(sd, buf, len, 0, (struct sockaddr*) &address, &addrlen) < 0)
     {
         perror("Error on recvfrom\n");
@@ -114,6 +173,7 @@ void send_control(int type)
     control_packet ctrl;
     ctrl.type = type;
 
+    TRACE(TRACE_CONTROL_SEND, -1, type);
     send_msg(tcp_sd, &ctrl, sizeof(control_packet));
 }
 
@@ -137,27 +197,483 @@ nack_packet* populate_nack(int* missing_packet_map)
     return nack;
 }
 
-int write_to_file(int fd, data_packet packet)
+/**
+  * Returns the first multicast lane with data waiting in 'readfds', or -1 if there is none.
+  */
+int ready_lane(fd_set* readfds)
+{
+    for (int lane = 0; lane<lanes; lane++)
+    {
+        if (FD_ISSET(m_sd[lane], readfds))
+        {
+            return lane;
+        }
+    }
+
+    return -1;
+}
+
+/**
+  * Sends a NACK_MSG and a nack_packet for the packets still missing in missing_packet_map.
+  * Returns the number of packets in the nack_packet.
+  */
+int send_nack(int* missing_packet_map, int64_t window_number)
+{
+    nack_packet* nack = populate_nack(missing_packet_map);
+    send_control(NACK_MSG);
+    send_msg(tcp_sd, nack, sizeof(nack_packet));
+    TRACE(TRACE_NACK_SEND, window_number, nack->missing_packet_count);
+
+    int missing_packet_count = nack->missing_packet_count;
+    free(nack);
+
+    return missing_packet_count;
+}
+
+/**
+  * Returns the earlier of 'deadline' and the next peer repair timer, 0 if neither is set.
+  */
+uint64_t next_wakeup(uint64_t deadline)
+{
+    uint64_t timer = peer_repair ? peer_next_timer(&peers) : 0;
+    if (timer != 0 && (deadline == 0 || timer < deadline))
+    {
+        return timer;
+    }
+
+    return deadline;
+}
+
+/**
+  * Converts a time in microseconds into a struct timeval for select().
+  */
+struct timeval to_timeval(uint64_t us)
+{
+    struct timeval tv;
+    tv.tv_sec = us / 1000000;
+    tv.tv_usec = us % 1000000;
+
+    return tv;
+}
+
+/**
+  * Writes the body of 'packet' to its place in the destination file.
+  */
+void write_to_file(int fd, data_packet* packet)
+{
+    if (pwrite(fd, packet->body, packet->packet_length,
+        WINDOW_OFFSET(packet->window_number) + WRITE_LOCATION(packet->packet_number)) != packet->packet_length)
+    {
+        perror("Failed to write to file");
+        exit(-1);
+    }
+}
+
+/**
+  * Checks a received packet whose body is at 'body', opening it first if the session is sealed.
+  * Returns 1 if it can be used, 0 if it is corrupt or forged.
+  */
+int check_packet(data_packet* packet, void* body)
+{
+    if (seal.cipher != SEAL_NONE)
+    {
+        return seal_open(&seal, packet, body);
+    }
+
+    return verify_packet_body(packet, body);
+}
+
+/**
+  * Turns 'len' bytes at 'offset' in the file into a hole, or writes zeros if the file system can't punch holes.
+  * Punching also clears anything a corrupt packet may have left there.
+  */
+void punch_hole(int fd, int64_t offset, int64_t len)
 {
-    lseek(fd, WINDOW_OFFSET(packet.window_number) + WRITE_LOCATION(packet.packet_number), SEEK_SET);
-    write(fd, packet.body, packet.packet_length);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+    {
+        return;
+    }
 
-    return fd;
+    static const char zeros[BUFFER_SIZE];
+    while (len > 0)
+    {
+        ssize_t nbytes = pwrite(fd, zeros, MIN(len, BUFFER_SIZE), offset);
+        if (nbytes <= 0)
+        {
+            perror("Failed to write zeros to file");
+            exit(-1);
+        }
+        offset += nbytes;
+        len -= nbytes;
+    }
 }
 
-int main(int argc, char const *argv[])
+/**
+  * Marks the packets of 'window_number' in 'zero_packets' as received, punching a hole for each run of them.
+  * Returns the number of packets that were still missing.
+  */
+int fill_zero_packets(int fd, int* missing_packet_map, const uint8_t* zero_packets, int64_t window_number)
 {
-    (void)argc;
+    int filled = 0, packet_number = 0;
+    while (packet_number < WINDOW_SIZE)
+    {
+        int end = packet_number;
+        while (end < WINDOW_SIZE && ZERO_MAP_TEST(zero_packets, end) && missing_packet_map[end] == 0)
+        {
+            missing_packet_map[end] = 1;
+            end++;
+        }
+
+        if (end == packet_number)
+        {
+            packet_number++;
+            continue;
+        }
+
+        int64_t offset = WINDOW_OFFSET(window_number) + WRITE_LOCATION(packet_number);
+        punch_hole(fd, offset, MIN(WRITE_LOCATION(end - packet_number), file_size - offset));
+        g_metrics.packets_sparse += end - packet_number;
+        filled += end - packet_number;
+        packet_number = end;
+    }
+
+    return filled;
+}
+
+/**
+  * Receives a data_packet from 'lane' into 'packet' and checks it.
+  * With -z, the body of a packet still missing from 'window_number' is received straight into the
+  * mapped file instead of packet->body, so it is never copied.
+  * Returns PACKET_CORRUPT, PACKET_RECEIVED, or PACKET_STORED if the body is already in the file.
+  */
+int receive_packet(int lane, data_packet* packet, int* missing_packet_map, int64_t window_number)
+{
+    size_t header_len = offsetof(data_packet, body);
+
+    /* Only the header is peeked, to find out where the body goes */
+    if (file_map != NULL
+        && recv(m_sd[lane], packet, header_len, MSG_PEEK) == (ssize_t) header_len
+        && packet->window_number == window_number
+        && packet->packet_number >= 0 && packet->packet_number < WINDOW_SIZE
+        && missing_packet_map[packet->packet_number] == 0
+        && WINDOW_OFFSET(window_number) + WRITE_LOCATION(packet->packet_number) < file_size)
+    {
+        int64_t offset = WINDOW_OFFSET(window_number) + WRITE_LOCATION(packet->packet_number);
+        size_t body_len = MIN(BUFFER_SIZE, file_size - offset);
+
+        /* Anything past the end of the file goes into packet->body */
+        struct iovec iov[3];
+        iov[0].iov_base = packet;
+        iov[0].iov_len = header_len;
+        iov[1].iov_base = file_map + offset;
+        iov[1].iov_len = body_len;
+        iov[2].iov_base = packet->body;
+        iov[2].iov_len = sizeof(data_packet) - header_len;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 3;
+        if (recvmsg(m_sd[lane], &msg, 0) < 0)
+        {
+            perror("Error on recvmsg\n");
+            exit(-1);
+        }
+
+        /* A corrupt body just leaves the packet missing, nothing else in the file is touched */
+        if (packet->packet_length < 0 || (size_t) packet->packet_length > body_len)
+        {
+            return PACKET_CORRUPT;
+        }
+        return check_packet(packet, file_map + offset) ? PACKET_STORED : PACKET_CORRUPT;
+    }
+
+    get_msg(packet, sizeof(data_packet), m_sd[lane], m_address[lane]);
+    return check_packet(packet, packet->body) ? PACKET_RECEIVED : PACKET_CORRUPT;
+}
+
+/**
+  * Waits for the server's reply to our ACK or RESEND of 'window_number' and stores it in 'reply'.
+  * With peer repair, receivers still missing packets are answered in the meantime.
+  */
+void get_server_reply(control_packet* reply, int* missing_packet_map, int64_t window_number)
+{
+    fd_set watched, readfds;
+    FD_ZERO(&watched);
+    FD_SET(tcp_sd, &watched);
+    if (peer_repair)
+    {
+        FD_SET(peers.sd, &watched);
+        for (int lane = 0; lane<lanes; lane++)
+        {
+            FD_SET(m_sd[lane], &watched);
+        }
+    }
+
+    while (peer_repair)
+    {
+        uint64_t now = metrics_now_us(), wake = next_wakeup(0);
+        struct timeval timeout = to_timeval((wake > now) ? wake - now : 0);
+
+        readfds = watched;
+        if (select(highest_sd+1, &readfds, NULL, NULL, (wake != 0) ? &timeout : NULL) < 0)
+        {
+            FD_ZERO(&readfds);
+        }
+
+        if (FD_ISSET(tcp_sd, &readfds))
+        {
+            break;
+        }
+
+        if (FD_ISSET(peers.sd, &readfds))
+        {
+            peer_recv(&peers, missing_packet_map);
+        }
+
+        /* Other receivers' repairs cancel ours, but the next window can start before the reply arrives */
+        int lane = ready_lane(&readfds);
+        if (lane >= 0)
+        {
+            data_packet packet;
+            if (recv(m_sd[lane], &packet, offsetof(data_packet, checksum), MSG_PEEK) >= 0
+                && packet.window_number != window_number)
+            {
+                FD_CLR(m_sd[lane], &watched);
+            }
+            else
+            {
+                get_msg(&packet, sizeof(packet), m_sd[lane], m_address[lane]);
+                if (check_packet(&packet, packet.body) && packet.window_number == window_number)
+                {
+                    peer_repair_seen(&peers, packet.packet_number);
+                }
+            }
+        }
+
+        peer_run_timers(&peers, missing_packet_map);
+    }
+
+    get_msg(reply, sizeof(control_packet), tcp_sd, tcp_address);
+}
+
+/**
+  * Gets the session key of a sealed session from the server, with the key exchange described in seal.h.
+  */
+void get_session_key(header_packet* header, const char* secret)
+{
+    key_packet request, reply;
+    memset(&request, 0, sizeof(key_packet));
+    EVP_PKEY* own = seal_keypair(request.share);
+    send_msg(tcp_sd, &request, sizeof(key_packet));
+
+    if (recv(tcp_sd, &reply, sizeof(key_packet), MSG_WAITALL) != sizeof(key_packet))
+    {
+        fprintf(stderr, "Server closed the connection during the key exchange\n");
+        exit(-1);
+    }
+
+    uint8_t key[SEAL_KEY_SIZE];
+    if (!seal_unwrap_key(header->cipher, own, header->key_share, &reply, secret, key))
+    {
+        fprintf(stderr, "Could not open the session key, the server has a different secret (-k)\n");
+        exit(-1);
+    }
+
+    seal_init(&seal, header->cipher, key);
+    OPENSSL_cleanse(key, SEAL_KEY_SIZE);
+    EVP_PKEY_free(own);
+}
+
+/**
+  * Starts a server next to this binary that re-multicasts 'filepath' as its windows are verified.
+  * 'spec' is "num_clients port [server options]", for example "4 9000 -g 233.0.134.0 -i eth1".
+  * 'upstream_group' is the group this client receives on, the relay has to send on another one.
+  */
+void start_relay(char* spec, const char* filepath, const char* upstream_group)
+{
+    int relay_pipe[2];
+    if (pipe(relay_pipe) < 0)
+    {
+        perror("Failed to create relay pipe");
+        exit(-1);
+    }
+
+    /* Let the downstream fall behind by as many windows as possible before it holds up the upstream */
+    fcntl(relay_pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+
+    char server_path[PATH_MAX], fd_arg[16];
+    ssize_t len = readlink("/proc/self/exe", server_path, sizeof(server_path) - 1);
+    if (len < 0)
+    {
+        perror("Failed to find the server binary");
+        exit(-1);
+    }
+    server_path[len] = '\0';
+    strcpy(server_path, dirname(server_path));
+    strcat(server_path, "/server");
+    snprintf(fd_arg, sizeof(fd_arg), "%d", RELAY_PIPE_FD);
+
+    /* server num_clients filepath port [options] -F fd */
+    char* args[MAX_RELAY_ARGS + 6];
+    const char* relay_group = MULTICAST_GROUP;
+    int argc = 0;
+    args[argc++] = server_path;
+    for (char* word = strtok(spec, " "); word != NULL && argc < MAX_RELAY_ARGS; word = strtok(NULL, " "))
+    {
+        if (strncmp(word, "-g", 2) == 0)
+        {
+            relay_group = word + 2;
+        }
+        else if (argc > 0 && strcmp(args[argc - 1], "-g") == 0)
+        {
+            relay_group = word;
+        }
+
+        args[argc++] = word;
+        if (argc == 2)
+        {
+            args[argc++] = (char*) filepath;
+        }
+    }
+    if (argc < 4)
+    {
+        fprintf(stderr, "Relay needs a number of clients and a port\n");
+        exit(-1);
+    }
+
+    /* Lanes use the same ports in every group, so on the upstream's group the two transfers would mix */
+    if (relay_group[0] == '\0' || strcmp(relay_group, upstream_group) == 0)
+    {
+        fprintf(stderr, "Relay needs its own multicast group, the upstream sends on %s (give the relay -g)\n",
+            upstream_group);
+        exit(-1);
+    }
+    args[argc++] = "-F";
+    args[argc++] = fd_arg;
+    args[argc] = NULL;
+
+    fflush(stdout);
+    if ((relay_pid = fork()) < 0)
+    {
+        perror("Failed to start relay server");
+        exit(-1);
+    }
+
+    if (relay_pid == 0)
+    {
+        /* The relay server only gets the pipe. Anything else it inherited, such as the upstream multicast sockets,
+           the destination file or a stream consumer, would stay open until the whole subtree has the file */
+        if (dup2(relay_pipe[0], RELAY_PIPE_FD) < 0 || close_range(RELAY_PIPE_FD + 1, ~0U, 0) < 0)
+        {
+            perror("Failed to start relay server");
+            _exit(-1);
+        }
+        execv(server_path, args);
+        perror("Failed to run relay server");
+        _exit(-1);
+    }
+
+    close(relay_pipe[0]);
+    relay_fd = relay_pipe[1];
+}
+
+/**
+  * Tells the downstream server 'window_number' has been verified and can be sent on.
+  */
+void relay_verified(int64_t window_number, int checksum)
+{
+    relay_window record;
+    record.window_number = window_number;
+    record.checksum = checksum;
+
+    if (write(relay_fd, &record, sizeof(record)) != sizeof(record))
+    {
+        perror("Failed to pass window to relay server");
+        exit(-1);
+    }
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [server_ip] [destination_path] [port] [-m json:path|prom:path] [-t trace_path]\n"
+        "       [-i interface,...] [-R \"num_clients port [server options]\"] [-z] [-k secret_file]\n"
+        "       [-s -|unix:path|fd:n|path] [-N notify_fd]\n", name);
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    char* relay_spec = NULL;
+    int zero_copy = 0;
+    char secret[SEAL_MAX_SECRET + 1] = "";
+    char* stream_target = NULL;
+    int notify_fd = -1;
+    while ((opt = getopt(argc, argv, "m:t:i:R:zk:s:N:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                metrics_init("client", optarg);
+                break;
+
+            case 't':
+                trace_init("client", optarg);
+                break;
+
+            case 'i':
+                num_interfaces = parse_interfaces(optarg, interfaces);
+                break;
+
+            case 'R':
+                relay_spec = optarg;
+                break;
+
+            case 'z':
+                zero_copy = 1;
+                break;
+
+            case 'k':
+                seal_read_secret(optarg, secret);
+                break;
+
+            case 's':
+                stream_target = optarg;
+                break;
+
+            case 'N':
+                notify_fd = atoi(optarg);
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 3)
+    {
+        usage(argv[0]);
+    }
 
     char server_ip[IP_LENGTH];
-    strcpy(server_ip, argv[1]);
+    strcpy(server_ip, argv[optind]);
 
     char file_dst_path[PATH_MAX];
-    strcpy(file_dst_path, argv[2]);
+    strcpy(file_dst_path, argv[optind + 1]);
+
+    int port = atoi(argv[optind + 2]);
+
+    /* Opened before anything is printed, as streaming to stdout moves our output to stderr */
+    if (stream_target != NULL || notify_fd >= 0)
+    {
+        stream_open(&stream, stream_target, notify_fd);
+        streaming = 1;
+    }
 
-    int port = atoi(argv[3]);
+    srand(time(NULL) ^ getpid());
+    rto_init(&nack_rto);
 
-    setup_client_multicast_socket();
     setup_client_tcp_socket(server_ip, port);
 
     /* Get header_packet */
@@ -166,6 +682,24 @@ int main(int argc, char const *argv[])
 
     print_header(header);
 
+    /* With a secret we only take sealed sessions, so the server can't be talked into sending in the clear */
+    if (header.cipher != SEAL_NONE)
+    {
+        get_session_key(&header, secret);
+    }
+    else if (secret[0] != '\0')
+    {
+        fprintf(stderr, "The server does not seal data packets, but a secret was given\n");
+        exit(-1);
+    }
+
+    /* The header says which group and how many lanes to join, the server waits until we have */
+    lanes = MAX(1, MIN(header.lanes, MAX_LANES));
+    for (int lane = 0; lane<lanes; lane++)
+    {
+        setup_client_multicast_socket(lane, header.group);
+    }
+
     char filepath[PATH_MAX + MAX_FILENAME];
     strcpy(filepath, file_dst_path);
     strcat(filepath, header.filename);
@@ -173,9 +707,53 @@ int main(int argc, char const *argv[])
     /* Open the file to write to */
     int fd = open(filepath, O_RDWR | O_TRUNC | O_CREAT, S_IRWXU | S_IRGRP | S_IROTH);
 
+    /* Sized up front as zero packets are never written, this also suits the mapping and a relay's server */
+    file_size = header.filesize;
+    if (ftruncate(fd, file_size) < 0)
+    {
+        perror("Failed to size destination file");
+        exit(-1);
+    }
+
+    if (zero_copy && file_size > 0)
+    {
+        if ((file_map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        {
+            perror("Failed to map destination file");
+            exit(-1);
+        }
+    }
+
+    if (relay_spec != NULL)
+    {
+        start_relay(relay_spec, filepath, header.group);
+    }
+
+    if (streaming)
+    {
+        stream_start(&stream, fd, file_size);
+    }
+
+    if (header.peer_repair)
+    {
+        struct in_addr peer_interface = { INADDR_ANY };
+        if (num_interfaces > 0)
+        {
+            peer_interface = interfaces[0];
+        }
+        peer_open(&peers, header.group, peer_interface, m_address, lanes, header.lane_mode, fd);
+        if (seal.cipher != SEAL_NONE)
+        {
+            peers.seal = &seal;
+        }
+        highest_sd = higher(peers.sd, highest_sd);
+        peer_repair = 1;
+    }
+    send_control(READY_MSG);
+
     /* Total packets and windows in this transfer */
-    int total_packets = header.packet_count;
-    int total_windows = header.filesize / (WINDOW_SIZE*BUFFER_SIZE);
+    int64_t total_packets = header.packet_count;
+    int64_t total_windows = header.filesize / (WINDOW_SIZE*BUFFER_SIZE);
 
     /* Map for checking which packets are missing */
     int missing_packet_map[WINDOW_SIZE];
@@ -185,21 +763,35 @@ int main(int argc, char const *argv[])
 
     /* master contains both the TCP and multicast socket descriptors */
     FD_ZERO(&master);
-    FD_SET(m_sd, &master);
     FD_SET(tcp_sd, &master);
 
-    /* multicastfds only contains the multicast socket descriptor */
+    /* multicastfds only contains the multicast socket descriptors */
     FD_ZERO(&multicastfds);
-    FD_SET(m_sd, &multicastfds);
+    for (int lane = 0; lane<lanes; lane++)
+    {
+        FD_SET(m_sd[lane], &master);
+        FD_SET(m_sd[lane], &multicastfds);
+    }
+
+    /* Peer requests are only read while repairing or waiting for the server */
+    if (peer_repair)
+    {
+        FD_SET(peers.sd, &multicastfds);
+    }
+
+    /* Checksum of every window the server has ACKed, checked against the server's once the file is done */
+    int file_checksum = 0, server_checksum = 0;
 
     data_packet packet;
-    int packets_received = 0, window_number = 0;
+    int64_t packets_received = 0, window_number = 0;
     while(window_number <= total_windows || packets_received < total_packets)
     {
-        int packets_left = total_packets - packets_received;
+        int64_t packets_left = total_packets - packets_received;
 
         /* Reset the missing_packet_map */
         memset(missing_packet_map, 0, sizeof(missing_packet_map)); 
+        metrics_window_start();
+        TRACE(TRACE_WINDOW_START, window_number, 0);
 
         /*
          * Set missing_packet_map if the next window is smaller than WINDOW_SIZE
@@ -225,16 +817,30 @@ int main(int argc, char const *argv[])
             select(highest_sd+1, &readfds, NULL, NULL, NULL);
 
             /* Got message from UDP socket so deal with it as a data_packet */
-            if (FD_ISSET(m_sd, &readfds))
+            int lane = ready_lane(&readfds);
+            if (lane >= 0)
             {
-                get_msg(&packet, sizeof(packet), m_sd, m_address);
+                int received = receive_packet(lane, &packet, missing_packet_map, window_number);
 
-                if (packet.window_number == window_number)
+                /* Corrupt packets are dropped and repaired through the NACK like lost ones */
+                if (received == PACKET_CORRUPT)
+                {
+                    TRACE(TRACE_PACKET_CORRUPT, window_number, packet.packet_number);
+                    g_metrics.window.packets_corrupt++;
+                }
+                /* Mirrored lanes deliver each packet more than once */
+                else if (packet.window_number == window_number && missing_packet_map[packet.packet_number] == 0)
                 {
-                    lseek(fd, WINDOW_OFFSET(packet.window_number) + WRITE_LOCATION(packet.packet_number), SEEK_SET);
-                    write(fd, packet.body, packet.packet_length);
+                    TRACE(TRACE_PACKET_RECV, packet.window_number, packet.packet_number);
+                    TRACE(TRACE_WRITE_START, packet.window_number, packet.packet_number);
+                    if (received != PACKET_STORED)
+                    {
+                        write_to_file(fd, &packet);
+                    }
+                    TRACE(TRACE_WRITE_END, packet.window_number, packet.packet_number);
 
                     missing_packet_map[packet.packet_number] = 1;
+                    g_metrics.window.bytes += packet.packet_length;
 
                     current_packets++;
                     packets_received++; 
@@ -254,81 +860,244 @@ int main(int argc, char const *argv[])
             }
         }
 
-        printf("Finished window %d, packets missing: %d, packets recieved: %d out of %d\n", window_number, packets_missing, current_packets, MIN(packets_left, WINDOW_SIZE));
-        printf("Overall process %d out of %d\n", packets_received, total_packets);
+        g_metrics.window.send_us = metrics_now_us() - g_metrics.window.start_us;
+
+        printf("Finished window %" PRId64 ", packets missing: %d, packets recieved: %d out of %d\n",
+            window_number, packets_missing, current_packets, (int) MIN(packets_left, WINDOW_SIZE));
+        printf("Overall process %" PRId64 " out of %" PRId64 "\n", packets_received, total_packets);
 
         /* Block until we receive the control_packet from the server indicating the end of the window */
         control_packet ctrl;
         get_msg(&ctrl, sizeof(control_packet), tcp_sd, tcp_address);
+        TRACE(TRACE_CONTROL_RECV, ctrl.window_number, ctrl.type);
 
         /* Sync our window number with the server */
         window_number = ctrl.window_number;
 
-        /* Create and send a nack_packet for any packets we missed in this window */
-        nack_packet* nack = populate_nack(missing_packet_map);
-        send_control(NACK_MSG);
-        send_msg(tcp_sd, nack, sizeof(nack_packet));
+        /* The server leaves out packets that are all zeros, they become holes instead */
+        int zero_packets = fill_zero_packets(fd, missing_packet_map, ctrl.zero_packets, window_number);
+        packets_missing -= zero_packets;
+        packets_received += zero_packets;
+        window_packets += zero_packets;
+
+        /*
+         * Create and send a nack_packet for any packets we missed in this window.
+         * With peer repair the other receivers are asked first, and the server only once they can't help.
+         */
+        uint64_t nack_sent = 0, deadline = 0;
+        int nack_resent = 0, rtt_sampled = 0;
+        if (peer_repair)
+        {
+            peer_window_start(&peers, window_number, nack_rto.has_sample ? nack_rto.srtt_us : 0);
+        }
 
-        /* Timeout for receiving packets we nacked before sending another nack */
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
+        if (peer_repair && packets_missing > 0)
+        {
+            peer_request_missing(&peers);
+        }
+        else
+        {
+            nack_sent = metrics_now_us();
+            int nacked = send_nack(missing_packet_map, window_number);
+            if (nacked > 0)
+            {
+                g_metrics.window.repair_rounds++;
+                g_metrics.window.packets_nacked += nacked;
+            }
+            deadline = nack_sent + rto_timeout_us(&nack_rto);
+        }
 
+        /*
+         * Another NACK is only sent once no repair has arrived for a whole timeout.
+         * RTT samples are only taken for the first NACK of a window as the repair
+         * for a resent NACK could be answering either one.
+         */
         while(packets_missing > 0)
         {
+            uint64_t now = metrics_now_us(), wake = next_wakeup(deadline);
+            struct timeval timeout = to_timeval((wake > now) ? wake - now : 0);
+
             /* Wait for data on multicast socket with select() */
             readfds = multicastfds;
-            select(highest_sd+1, &readfds, NULL, NULL, &timeout);
+            if (select(highest_sd+1, &readfds, NULL, NULL, &timeout) < 0)
+            {
+                FD_ZERO(&readfds);
+            }
 
-            if (FD_ISSET(m_sd, &readfds))
+            int lane = ready_lane(&readfds);
+            if (lane >= 0)
             {
-                get_msg(&packet, sizeof(packet), m_sd, m_address);
+                int received = receive_packet(lane, &packet, missing_packet_map, window_number);
 
-                if (missing_packet_map[packet.packet_number] == 0)
+                if (received == PACKET_CORRUPT)
                 {
-                    lseek(fd, WINDOW_OFFSET(packet.window_number) + WRITE_LOCATION(packet.packet_number), SEEK_SET);
-                    write(fd, packet.body, packet.packet_length);
+                    TRACE(TRACE_PACKET_CORRUPT, window_number, packet.packet_number);
+                    g_metrics.window.packets_corrupt++;
+                }
+                else if (packet.window_number == window_number && missing_packet_map[packet.packet_number] == 0)
+                {
+                    TRACE(TRACE_REPAIR_RECV, packet.window_number, packet.packet_number);
+                    TRACE(TRACE_WRITE_START, packet.window_number, packet.packet_number);
+                    if (received != PACKET_STORED)
+                    {
+                        write_to_file(fd, &packet);
+                    }
+                    TRACE(TRACE_WRITE_END, packet.window_number, packet.packet_number);
 
                     missing_packet_map[packet.packet_number] = 1;
+                    g_metrics.window.bytes += packet.packet_length;
+                    g_metrics.window.packets_resent++;
                     packets_missing--;
                     packets_received++;
                     window_packets++;
+
+                    /* Peer repairs wait out random timers, so only the server's round trip is sampled */
+                    now = metrics_now_us();
+                    if (deadline != 0 && !nack_resent && !rtt_sampled)
+                    {
+                        rto_sample(&nack_rto, now - nack_sent);
+                        metrics_repair_rtt(now - nack_sent);
+                        rtt_sampled = 1;
+                    }
+
+                    /* Repairs are still arriving, so hold off the next NACK */
+                    if (deadline != 0)
+                    {
+                        deadline = now + rto_timeout_us(&nack_rto);
+                    }
+                }
+                else if (peer_repair && packet.window_number == window_number)
+                {
+                    peer_repair_seen(&peers, packet.packet_number);
                 }
             }
 
-            /* Send another nack as timeout as passed */
-            else
+            else if (peer_repair && FD_ISSET(peers.sd, &readfds))
+            {
+                peer_recv(&peers, missing_packet_map);
+            }
+
+            /* Send another nack as no repair arrived before the timeout */
+            else if (deadline != 0 && metrics_now_us() >= deadline)
+            {
+                rto_backoff(&nack_rto);
+                int nacked = send_nack(missing_packet_map, window_number);
+                g_metrics.window.repair_rounds++;
+                g_metrics.window.packets_nacked += nacked;
+
+                nack_resent = 1;
+                deadline = metrics_now_us() + rto_timeout_us(&nack_rto);
+            }
+
+            if (peer_repair && packets_missing > 0)
             {
-                free(nack);
-                nack = populate_nack(missing_packet_map);
-                send_control(NACK_MSG);
-                send_msg(tcp_sd, nack, sizeof(nack_packet));
+                peer_run_timers(&peers, missing_packet_map);
+
+                /* None of the other receivers had the rest, so ask the server */
+                if (deadline == 0 && peer_fallback(&peers))
+                {
+                    nack_sent = metrics_now_us();
+                    int nacked = send_nack(missing_packet_map, window_number);
+                    g_metrics.window.repair_rounds++;
+                    g_metrics.window.packets_nacked += nacked;
+                    deadline = nack_sent + rto_timeout_us(&nack_rto);
+                }
             }
         }
-        free(nack);
 
-        int checksum = get_checksum(fd, WINDOW_OFFSET(ctrl.window_number), ctrl.window_offset);
+        uint64_t checksum_start = metrics_now_us();
+        TRACE(TRACE_CHECKSUM_START, ctrl.window_number, 0);
+        int checksum;
+        if (file_map != NULL)
+        {
+            /* The window is already in memory, so skip reading it back */
+            int64_t start = WINDOW_OFFSET(ctrl.window_number), stop = MIN(ctrl.window_offset, file_size);
+            checksum = crc32_sparse(0, file_map + start, MAX(stop - start, 0));
+        }
+        else
+        {
+            checksum = get_checksum(fd, WINDOW_OFFSET(ctrl.window_number), ctrl.window_offset);
+        }
+        TRACE(TRACE_CHECKSUM_END, ctrl.window_number, 0);
+        metrics_checksum(checksum_start);
         printf("Control checksum: %d\tWindow checksum: %d\n\n", ctrl.checksum, checksum);
 
         /* Send control_packet back to server */
         (ctrl.checksum != checksum) ? send_control(RESEND_MSG) : send_control(ACK_MSG);
+        uint64_t ack_sent = metrics_now_us();
 
         /* Get final control_packet from server */
         control_packet server_ack;
-        get_msg(&server_ack, sizeof(control_packet), tcp_sd, tcp_address);
-        (server_ack.type == RESEND_MSG) ? packets_received -= MIN(WINDOW_SIZE, window_packets) : window_number++;
+        get_server_reply(&server_ack, missing_packet_map, window_number);
+        TRACE(TRACE_CONTROL_RECV, window_number, server_ack.type);
+        metrics_ack_latency(metrics_now_us() - ack_sent);
+
+        g_metrics.packets += current_packets + g_metrics.window.packets_resent;
+        g_metrics.bytes += g_metrics.window.bytes;
+        metrics_socket_drops(m_sd, lanes);
+        metrics_window_end(window_number, server_ack.type == RESEND_MSG);
+        TRACE(TRACE_WINDOW_END, window_number, 0);
+        if (server_ack.type == RESEND_MSG)
+        {
+            packets_received -= MIN(WINDOW_SIZE, window_packets);
+        }
+        else
+        {
+            file_checksum = fold_checksum(file_checksum, checksum);
+            server_checksum = server_ack.checksum;
+            if (relay_fd >= 0)
+            {
+                relay_verified(window_number, checksum);
+            }
+            if (streaming)
+            {
+                stream_verified(&stream, MIN(WINDOW_OFFSET(window_number + 1), file_size));
+            }
+            window_number++;
+        }
     }
 
-    /* End of file final checksum */
-    off_t stop_offset = lseek(fd, 0, SEEK_END);
-    int checksum = get_checksum(fd, 0, stop_offset);
-
-    printf("Header checksum: %d\nFinal checksum: %d\n", header.checksum, checksum);
+    /* The file checksum is built from the verified window checksums so the file is not read again.
+       It catches a window ACKed out of step with the server, and a file that changed since the server's cache
+       was written (the header carries the cached checksum, 0 if the server did not have one) */
+    printf("Server checksum: %d\nFinal checksum: %d\n", server_checksum, file_checksum);
+    int checksum_ok = file_checksum == server_checksum && (header.checksum == 0 || header.checksum == file_checksum);
+    if (!checksum_ok)
+    {
+        fprintf(stderr, "File checksum does not match the server's (header checksum: %d)\n", header.checksum);
+    }
 
     /* Clean up */
     close(tcp_sd);
+    if (file_map != NULL)
+    {
+        munmap(file_map, file_size);
+    }
+    if (peer_repair)
+    {
+        peer_close(&peers);
+    }
+    if (seal.cipher != SEAL_NONE)
+    {
+        seal_close(&seal);
+    }
+    if (streaming)
+    {
+        stream_close(&stream);
+    }
     close(fd);
-    printf("Done.\n");
 
-    return 0;
+    /* Stay around until the subtree has the file too */
+    if (relay_fd >= 0)
+    {
+        int status;
+        close(relay_fd);
+        waitpid(relay_pid, &status, 0);
+        printf("Relay finished with status %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+    printf(checksum_ok ? "Done.\n" : "Done, but the file checksum is wrong.\n");
+    metrics_finish();
+    trace_finish();
+
+    return checksum_ok ? 0 : -1;
 }
@@ -1,27 +1,216 @@
+#include <pthread.h>
+
 #include "header.h"
 
+/* CRC32 polynomial of crc32.c, bit reversed */
+#define CRC32_POLY 0xedb88320
+
+/* Operator that feeds BUFFER_SIZE zero bytes through a CRC32, built on first use */
+static uint32_t zeros_op[32];
+static pthread_once_t zeros_once = PTHREAD_ONCE_INIT;
+
 void print_header(header_packet header)
 {
     printf("Header packet recieved\n");
-    printf("filesize: %d\npack_size: %d\npacket_count: %d\nfilename: %s\nfile checksum: %d\n",
+    printf("filesize: %" PRId64 "\npack_size: %d\npacket_count: %" PRId64 "\nfilename: %s\nfile checksum: %d\n",
     header.filesize, header.packet_size, header.packet_count, header.filename, header.checksum);
+    printf("group: %s\nlanes: %d\n", header.group, header.lanes);
 }
 
 
 int get_checksum(int fd, off_t start_offset, off_t stop_offset)
 {
-	off_t nbytes;
-	uint32_t checksum;
-
-	/* lseek to the starting offset */
-	lseek(fd, start_offset, SEEK_SET);
+	char buffer[BUFFER_SIZE];
+	uint32_t checksum = 0;
+	ssize_t nbytes;
 
-	crc32(fd, &checksum, &nbytes, stop_offset);
+	/* pread() leaves the file offset alone so this is safe to call from several threads */
+	while (start_offset < stop_offset
+		&& (nbytes = pread(fd, buffer, MIN((off_t) BUFFER_SIZE, stop_offset - start_offset), start_offset)) > 0)
+	{
+		checksum = crc32_sparse(checksum, buffer, nbytes);
+		start_offset += nbytes;
+	}
 
 	return checksum;
 }
 
 
+/**
+  * Multiplies 'vec' by the GF(2) 'matrix', one column per bit.
+  */
+static uint32_t gf2_times(const uint32_t* matrix, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (int n = 0; vec != 0; n++, vec >>= 1)
+    {
+        if (vec & 1)
+        {
+            sum ^= matrix[n];
+        }
+    }
+
+    return sum;
+}
+
+/**
+  * Builds zeros_op, as in zlib's crc32_combine(): the operator for one zero bit is squared
+  * until it covers BUFFER_SIZE bytes, which only works as BUFFER_SIZE is a power of two.
+  */
+static void build_zeros_op(void)
+{
+    uint32_t op[32], square[32];
+    op[0] = CRC32_POLY;
+    for (int n = 1; n<32; n++)
+    {
+        op[n] = 1u << (n - 1);
+    }
+
+    for (int64_t bits = 1; bits < 8 * BUFFER_SIZE; bits *= 2)
+    {
+        for (int n = 0; n<32; n++)
+        {
+            square[n] = gf2_times(op, op[n]);
+        }
+        memcpy(op, square, sizeof(op));
+    }
+
+    memcpy(zeros_op, op, sizeof(op));
+}
+
+uint32_t crc32_sparse(uint32_t checksum, const void* buf, size_t len)
+{
+    pthread_once(&zeros_once, build_zeros_op);
+
+    const char* p = buf;
+    while (len > 0)
+    {
+        size_t chunk = MIN(len, (size_t) BUFFER_SIZE);
+        if (chunk == BUFFER_SIZE && is_zero(p, chunk))
+        {
+            /* crc32_buffer() inverts the CRC before and after, zeros_op works on the register in between */
+            checksum = ~gf2_times(zeros_op, ~checksum);
+        }
+        else
+        {
+            checksum = crc32_buffer(checksum, p, chunk);
+        }
+        p += chunk;
+        len -= chunk;
+    }
+
+    return checksum;
+}
+
+
+int is_zero(const void* buf, size_t len)
+{
+    const unsigned char* p = buf;
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+
+int fold_checksum(int file_checksum, int window_checksum)
+{
+	return crc32_buffer(file_checksum, &window_checksum, sizeof(window_checksum));
+}
+
+
+/**
+  * Checksum of the header fields of 'packet' followed by 'body'.
+  */
+static uint32_t checksum_with_body(data_packet* packet, const void* body)
+{
+    uint32_t checksum = 0;
+    checksum = crc32_buffer(checksum, &packet->packet_number, sizeof(packet->packet_number));
+    checksum = crc32_buffer(checksum, &packet->packet_length, sizeof(packet->packet_length));
+    checksum = crc32_buffer(checksum, &packet->window_number, sizeof(packet->window_number));
+
+    return crc32_buffer(checksum, body, packet->packet_length);
+}
+
+uint32_t get_packet_checksum(data_packet* packet)
+{
+    return checksum_with_body(packet, packet->body);
+}
+
+
+int verify_packet(data_packet* packet)
+{
+    return verify_packet_body(packet, packet->body);
+}
+
+
+int verify_packet_body(data_packet* packet, const void* body)
+{
+    /* Check the header first so a corrupt length is never used to read the body */
+    if (packet->packet_number < 0 || packet->packet_number >= WINDOW_SIZE
+        || packet->packet_length < 0 || packet->packet_length > BUFFER_SIZE
+        || packet->window_number < 0)
+    {
+        return 0;
+    }
+
+    return checksum_with_body(packet, body) == packet->checksum;
+}
+
+
+/**
+  * Looks up the IPv4 address of the interface called 'name'.
+  * Returns 0 on success and -1 if there is no such interface.
+  */
+static int interface_address(const char* name, struct in_addr* address)
+{
+    struct ifaddrs* addrs;
+    if (getifaddrs(&addrs) < 0)
+    {
+        return -1;
+    }
+
+    int found = -1;
+    for (struct ifaddrs* current = addrs; current != NULL; current = current->ifa_next)
+    {
+        if (current->ifa_addr != NULL && current->ifa_addr->sa_family == AF_INET && strcmp(current->ifa_name, name) == 0)
+        {
+            *address = ((struct sockaddr_in*) current->ifa_addr)->sin_addr;
+            found = 0;
+            break;
+        }
+    }
+
+    freeifaddrs(addrs);
+    return found;
+}
+
+
+int parse_interfaces(const char* list, struct in_addr interfaces[])
+{
+    char names[PATH_MAX];
+    strncpy(names, list, sizeof(names) - 1);
+    names[sizeof(names) - 1] = '\0';
+
+    int count = 0;
+    char* save;
+    for (char* name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+    {
+        if (count == MAX_LANES)
+        {
+            fprintf(stderr, "At most %d interfaces can be used\n", MAX_LANES);
+            exit(-1);
+        }
+
+        if (inet_aton(name, &interfaces[count]) == 0 && interface_address(name, &interfaces[count]) < 0)
+        {
+            fprintf(stderr, "No IPv4 interface called '%s'\n", name);
+            exit(-1);
+        }
+        count++;
+    }
+
+    return count;
+}
+
+
 int higher(int a, int b)
 {
 	return (a > b) ? a : b;
@@ -116,3 +116,18 @@ int crc32(int fd, uint32_t *cval, off_t *clen, off_t offset)
     crc32_total = ~crc32_total ;
     return 0 ;
 }
+
+/*
+ * CRC of an in-memory buffer. Pass 0 to start, or the result of a
+ * previous call to continue the checksum over another buffer.
+ */
+uint32_t crc32_buffer(uint32_t cval, const void *buf, size_t len)
+{
+    uint32_t lcrc = ~cval;
+    const unsigned char *p = buf;
+
+    while (len--)
+        CRC(lcrc, *p++);
+
+    return ~lcrc;
+}
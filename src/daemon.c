@@ -0,0 +1,567 @@
+/* For accept4 */
+#define _GNU_SOURCE
+
+#include "header.h"
+#include "daemon.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* How often the scheduler wakes up to reap finished sessions without a command arriving */
+#define SCHEDULER_TICK_US 200000
+
+job jobs[MAX_JOBS];
+int job_count = 0, next_job_id = 1;
+int running = 0, session_slots[MAX_SESSIONS + 1];
+
+uint64_t total_bandwidth = 0;
+int session_limit = 1;
+
+control_connection connections[MAX_CONTROL_CONNECTIONS];
+
+const char* job_state_name(int state)
+{
+    switch (state)
+    {
+        case JOB_QUEUED: return "queued";
+        case JOB_RUNNING: return "running";
+        case JOB_DONE: return "done";
+        case JOB_FAILED: return "failed";
+        case JOB_CANCELLED: return "cancelled";
+        default: return "unknown";
+    }
+}
+
+int setup_control_socket(const char* control_path)
+{
+    int sd;
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        perror("Control socket could not be created");
+        exit(-1);
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(control_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Control socket path is too long\n");
+        exit(-1);
+    }
+    strcpy(address.sun_path, control_path);
+
+    /* A socket left behind by a previous daemon would make bind fail */
+    unlink(control_path);
+    if (bind(sd, (struct sockaddr*) &address, sizeof(address)) < 0)
+    {
+        perror("Failed to bind to control socket");
+        exit(-1);
+    }
+
+    if (listen(sd, MAX_CONNECTIONS) < 0)
+    {
+        perror("Failed to listen on control socket");
+        exit(-1);
+    }
+
+    return sd;
+}
+
+job* find_job(int id)
+{
+    for (int i = 0; i<job_count; i++)
+    {
+        if (jobs[i].id == id)
+        {
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+  * Returns an unused job entry, reusing the oldest finished job once the table is full.
+  */
+job* new_job()
+{
+    if (job_count < MAX_JOBS)
+    {
+        return &jobs[job_count++];
+    }
+
+    for (int i = 0; i<job_count; i++)
+    {
+        if (jobs[i].state != JOB_QUEUED && jobs[i].state != JOB_RUNNING)
+        {
+            memmove(&jobs[i], &jobs[i + 1], (job_count - i - 1) * sizeof(job));
+            return &jobs[job_count - 1];
+        }
+    }
+    return NULL;
+}
+
+/**
+  * Gives every running session its share of the bandwidth, in proportion to its priority.
+  */
+void share_bandwidth()
+{
+    int total_priority = 0;
+    for (int i = 0; i<job_count; i++)
+    {
+        if (jobs[i].state == JOB_RUNNING)
+        {
+            total_priority += jobs[i].priority;
+        }
+    }
+
+    for (int i = 0; i<job_count; i++)
+    {
+        if (jobs[i].state != JOB_RUNNING)
+        {
+            continue;
+        }
+
+        /* A session that already exited fails the write and is picked up by reap_sessions() */
+        uint64_t rate = total_bandwidth * jobs[i].priority / total_priority;
+        if (rate != jobs[i].rate && write(jobs[i].rate_fd, &rate, sizeof(rate)) == sizeof(rate))
+        {
+            jobs[i].rate = rate;
+        }
+    }
+}
+
+/**
+  * Forks a session for 'j' on a free multicast group.
+  */
+void start_session(job* j, int control_sd)
+{
+    int slot = 1;
+    while (session_slots[slot])
+    {
+        slot++;
+    }
+
+    int rate_pipe[2];
+    if (pipe(rate_pipe) < 0)
+    {
+        perror("Failed to create rate pipe");
+        exit(-1);
+    }
+
+    char group[IP_LENGTH];
+    snprintf(group, sizeof(group), SESSION_GROUP, slot);
+
+    /* Don't let the session print anything still buffered */
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Failed to fork session");
+        exit(-1);
+    }
+
+    if (pid == 0)
+    {
+        /* The session only needs its own end of its own pipe */
+        close(control_sd);
+        for (int i = 0; i<MAX_CONTROL_CONNECTIONS; i++)
+        {
+            if (connections[i].sd >= 0)
+            {
+                close(connections[i].sd);
+            }
+        }
+        close(rate_pipe[1]);
+        for (int i = 0; i<job_count; i++)
+        {
+            if (jobs[i].pid != 0)
+            {
+                close(jobs[i].rate_fd);
+            }
+        }
+        signal(SIGPIPE, SIG_DFL);
+        fcntl(rate_pipe[0], F_SETFL, O_NONBLOCK);
+
+        exit(run_session(j->num_clients, j->filepath, j->port, group, 0, rate_pipe[0]));
+    }
+
+    close(rate_pipe[0]);
+    session_slots[slot] = 1;
+    j->state = JOB_RUNNING;
+    j->pid = pid;
+    j->slot = slot;
+    j->rate_fd = rate_pipe[1];
+    j->rate = 0;
+    running++;
+    printf("Job %d started on %s port %d: %s\n", j->id, group, j->port, j->filepath);
+}
+
+/**
+  * Starts queued jobs, highest priority and then oldest first, while there are free sessions.
+  */
+void schedule(int control_sd)
+{
+    while (running < session_limit)
+    {
+        job* next = NULL;
+        for (int i = 0; i<job_count; i++)
+        {
+            if (jobs[i].state == JOB_QUEUED && (next == NULL || jobs[i].priority > next->priority))
+            {
+                next = &jobs[i];
+            }
+        }
+
+        if (next == NULL)
+        {
+            break;
+        }
+        start_session(next, control_sd);
+    }
+
+    if (total_bandwidth > 0)
+    {
+        share_bandwidth();
+    }
+}
+
+void reap_sessions()
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int i = 0; i<job_count; i++)
+        {
+            if (jobs[i].state != JOB_RUNNING && jobs[i].state != JOB_CANCELLED)
+            {
+                continue;
+            }
+            if (jobs[i].pid != pid)
+            {
+                continue;
+            }
+
+            if (jobs[i].state == JOB_RUNNING)
+            {
+                jobs[i].state = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? JOB_DONE : JOB_FAILED;
+            }
+            printf("Job %d %s\n", jobs[i].id, job_state_name(jobs[i].state));
+
+            close(jobs[i].rate_fd);
+            session_slots[jobs[i].slot] = 0;
+            jobs[i].pid = 0;
+            running--;
+        }
+    }
+}
+
+/**
+  * Runs one command from 'line' and writes the reply to 'out'.
+  */
+void handle_command(char* line, FILE* out)
+{
+    int num_clients, port, priority, id, offset = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (sscanf(line, "PUSH %d %d %d %n", &num_clients, &port, &priority, &offset) == 3 && offset > 0)
+    {
+        char* filepath = line + offset;
+        if (num_clients < 1 || num_clients > MAX_CONNECTIONS || priority < 1 || access(filepath, R_OK) < 0)
+        {
+            fprintf(out, "ERR invalid job\n");
+            return;
+        }
+
+        job* j = new_job();
+        if (j == NULL)
+        {
+            fprintf(out, "ERR too many jobs\n");
+            return;
+        }
+
+        memset(j, 0, sizeof(job));
+        j->id = next_job_id++;
+        j->state = JOB_QUEUED;
+        j->priority = priority;
+        j->num_clients = num_clients;
+        j->port = port;
+        j->rate_fd = -1;
+        strncpy(j->filepath, filepath, PATH_MAX - 1);
+        fprintf(out, "OK %d\n", j->id);
+    }
+    else if (strcmp(line, "LIST") == 0)
+    {
+        for (int i = 0; i<job_count; i++)
+        {
+            fprintf(out, "%d %s priority=%d clients=%d port=%d rate=%" PRIu64 " %s\n", jobs[i].id,
+                job_state_name(jobs[i].state), jobs[i].priority, jobs[i].num_clients, jobs[i].port, jobs[i].rate, jobs[i].filepath);
+        }
+        fprintf(out, "END\n");
+    }
+    else if (sscanf(line, "CANCEL %d", &id) == 1)
+    {
+        job* j = find_job(id);
+        if (j == NULL || (j->state != JOB_QUEUED && j->state != JOB_RUNNING))
+        {
+            fprintf(out, "ERR no such job\n");
+            return;
+        }
+
+        /* Running sessions are cleaned up once reaped */
+        if (j->state == JOB_RUNNING)
+        {
+            kill(j->pid, SIGTERM);
+        }
+        j->state = JOB_CANCELLED;
+        fprintf(out, "OK %d\n", j->id);
+    }
+    else
+    {
+        fprintf(out, "ERR unknown command\n");
+    }
+}
+
+void close_connection(control_connection* c)
+{
+    close(c->sd);
+    free(c->reply);
+    c->sd = -1;
+    c->reply = NULL;
+}
+
+/**
+  * Takes a new control connection, or turns it away if every entry is in use.
+  */
+void accept_connection(int control_sd)
+{
+    int sd = accept4(control_sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sd < 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i<MAX_CONTROL_CONNECTIONS; i++)
+    {
+        if (connections[i].sd < 0)
+        {
+            memset(&connections[i], 0, sizeof(control_connection));
+            connections[i].sd = sd;
+            connections[i].last_active = time(NULL);
+            return;
+        }
+    }
+
+    send(sd, "ERR too many connections\n", 25, MSG_NOSIGNAL);
+    close(sd);
+}
+
+/**
+  * Adds 'length' bytes of 'reply' after the replies 'c' has not written yet.
+  */
+void queue_reply(control_connection* c, const char* reply, size_t length)
+{
+    if ((c->reply = realloc(c->reply, c->reply_length + length)) == NULL)
+    {
+        perror("Failed to buffer control replies");
+        exit(-1);
+    }
+    memcpy(c->reply + c->reply_length, reply, length);
+    c->reply_length += length;
+}
+
+/**
+  * Runs every complete line received on 'c' and queues the replies.
+  * At the end of the stream a last line without a newline is run too.
+  */
+void run_commands(control_connection* c, int end_of_stream)
+{
+    char* replies;
+    size_t replies_length;
+    FILE* out = open_memstream(&replies, &replies_length);
+    if (out == NULL)
+    {
+        perror("Failed to buffer control replies");
+        exit(-1);
+    }
+
+    char* start = c->line;
+    char* end = c->line + c->line_length;
+    char* newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL)
+    {
+        *newline = '\0';
+        handle_command(start, out);
+        start = newline + 1;
+    }
+
+    c->line_length = end - start;
+    memmove(c->line, start, c->line_length);
+    if (end_of_stream && c->line_length > 0)
+    {
+        c->line[c->line_length] = '\0';
+        handle_command(c->line, out);
+        c->line_length = 0;
+    }
+    fclose(out);
+
+    queue_reply(c, replies, replies_length);
+    free(replies);
+}
+
+/**
+  * Reads what has arrived on 'c' without blocking.
+  * Nothing more is read while replies are waiting to be written, so a client that doesn't read them
+  * can't make the daemon buffer without limit.
+  */
+void read_connection(control_connection* c)
+{
+    ssize_t nbytes = recv(c->sd, c->line + c->line_length, CONTROL_LINE - 1 - c->line_length, 0);
+    if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (nbytes < 0)
+    {
+        close_connection(c);
+        return;
+    }
+
+    c->last_active = time(NULL);
+    c->line_length += nbytes;
+    c->closing = (nbytes == 0);
+
+    /* The rest of a line that was too long is thrown away up to its newline */
+    if (c->skipping)
+    {
+        char* newline = memchr(c->line, '\n', c->line_length);
+        size_t skipped = (newline != NULL) ? (size_t) (newline + 1 - c->line) : c->line_length;
+        c->line_length -= skipped;
+        memmove(c->line, c->line + skipped, c->line_length);
+        c->skipping = (newline == NULL);
+    }
+    if (!c->skipping)
+    {
+        run_commands(c, c->closing);
+    }
+
+    /* The buffer filled up without a newline */
+    if (c->line_length == CONTROL_LINE - 1)
+    {
+        const char error[] = "ERR line too long\n";
+        queue_reply(c, error, sizeof(error) - 1);
+        c->line_length = 0;
+        c->skipping = 1;
+    }
+}
+
+/**
+  * Writes as much of the queued replies on 'c' as the socket takes, and closes it once done if the client has.
+  */
+void write_connection(control_connection* c)
+{
+    if (c->reply_sent < c->reply_length)
+    {
+        ssize_t nbytes = send(c->sd, c->reply + c->reply_sent, c->reply_length - c->reply_sent, MSG_NOSIGNAL);
+        if (nbytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            close_connection(c);
+            return;
+        }
+        if (nbytes > 0)
+        {
+            c->reply_sent += nbytes;
+            c->last_active = time(NULL);
+        }
+    }
+
+    if (c->reply_sent == c->reply_length)
+    {
+        free(c->reply);
+        c->reply = NULL;
+        c->reply_length = c->reply_sent = 0;
+        if (c->closing)
+        {
+            close_connection(c);
+        }
+    }
+}
+
+int run_daemon(const char* control_path, uint64_t bandwidth, int max_sessions)
+{
+    total_bandwidth = bandwidth;
+    session_limit = max_sessions;
+
+    /* Replies to a control client that hung up, or rates to a session that exited, are not fatal */
+    signal(SIGPIPE, SIG_IGN);
+
+    int control_sd = setup_control_socket(control_path);
+    printf("Listening for jobs on %s\n", control_path);
+
+    for (int i = 0; i<MAX_CONTROL_CONNECTIONS; i++)
+    {
+        connections[i].sd = -1;
+    }
+
+    while (1)
+    {
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(control_sd, &readfds);
+        int highest_sd = control_sd;
+
+        /* A connection is either waiting for its replies to be written or for more commands */
+        for (int i = 0; i<MAX_CONTROL_CONNECTIONS; i++)
+        {
+            control_connection* c = &connections[i];
+            if (c->sd < 0)
+            {
+                continue;
+            }
+            FD_SET(c->sd, (c->reply_length > 0) ? &writefds : &readfds);
+            highest_sd = MAX(highest_sd, c->sd);
+        }
+
+        struct timeval tick = { 0, SCHEDULER_TICK_US };
+        if (select(highest_sd + 1, &readfds, &writefds, NULL, &tick) < 0 && errno != EINTR)
+        {
+            perror("Failed on selecting socket");
+            exit(-1);
+        }
+
+        time_t now = time(NULL);
+        for (int i = 0; i<MAX_CONTROL_CONNECTIONS; i++)
+        {
+            control_connection* c = &connections[i];
+            if (c->sd >= 0 && FD_ISSET(c->sd, &readfds))
+            {
+                read_connection(c);
+            }
+            if (c->sd >= 0 && (FD_ISSET(c->sd, &writefds) || c->reply_length > 0 || c->closing))
+            {
+                write_connection(c);
+            }
+
+            /* Connections that go quiet are dropped so they can't keep an entry forever */
+            if (c->sd >= 0 && now - c->last_active > CONTROL_IDLE_SEC)
+            {
+                close_connection(c);
+            }
+        }
+
+        if (FD_ISSET(control_sd, &readfds))
+        {
+            accept_connection(control_sd);
+        }
+
+        reap_sessions();
+        schedule(control_sd);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef __MCAST_DAEMON_H
+#define __MCAST_DAEMON_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <linux/limits.h>
+
+/*
+ * Daemon mode for the server.
+ * Transfer jobs are submitted over a local control socket, one line per command:
+ *
+ *   PUSH <num_clients> <port> <priority> <filepath>   queue a transfer, replies "OK <job id>"
+ *   LIST                                              one line per job, then "END"
+ *   CANCEL <job id>                                   stop a queued or running transfer
+ *
+ * Up to max_sessions jobs run at once, each in its own process on its own multicast group
+ * and TCP port. Queued jobs are started highest priority first, and running jobs share the
+ * bandwidth limit in proportion to their priority.
+ */
+
+#define MAX_SESSIONS 16
+#define MAX_JOBS 256
+#define CONTROL_LINE (PATH_MAX + 64)
+
+/* Control connections open at once, and how long one may go quiet before it is dropped */
+#define MAX_CONTROL_CONNECTIONS 16
+#define CONTROL_IDLE_SEC 10
+
+/* Multicast group of daemon session 'slot', slot 0 is the standalone server's MULTICAST_GROUP */
+#define SESSION_GROUP "233.0.133.%d"
+
+/* Job states */
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+#define JOB_CANCELLED 4
+
+typedef struct job
+{
+    int id;
+    int state;
+    int priority;
+    int num_clients;
+    int port;
+    char filepath[PATH_MAX];
+
+    /* Only set while running */
+    pid_t pid;
+    int slot;
+    int rate_fd;
+    uint64_t rate;
+
+} job;
+
+/*
+ * A control connection, read and written without blocking so a slow client can't hold up the scheduler.
+ */
+typedef struct control_connection
+{
+    int sd;             /* -1 if the entry is free */
+    time_t last_active;
+
+    /* Start of a command line still being received */
+    char line[CONTROL_LINE];
+    size_t line_length;
+    int skipping;       /* Throwing away the rest of a line that was too long */
+
+    /* Replies not yet written, and whether to close once they are */
+    char* reply;
+    size_t reply_length;
+    size_t reply_sent;
+    int closing;
+
+} control_connection;
+
+
+/**
+  * Runs the daemon until it is killed, listening for commands on the unix socket at 'control_path'.
+  * 'bandwidth' is the total send rate in bytes per second shared by all sessions, 0 for no limit.
+  */
+int run_daemon(const char* control_path, uint64_t bandwidth, int max_sessions);
+
+/**
+  * Runs a single transfer of 'filepath' to 'num_clients' clients, as the standalone server does.
+  * Sends to 'group' at no more than 'rate' bytes per second (0 for no limit).
+  * If 'rate_fd' is not -1, new rates are read from it at the start of every window.
+  */
+int run_session(int num_clients, char* filepath, int port, const char* group, uint64_t rate, int rate_fd);
+
+#endif
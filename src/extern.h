@@ -45,6 +45,7 @@ void	psum2(char *, uint32_t, off_t);
 int	csum1(int, uint32_t *, off_t *);
 int	csum2(int, uint32_t *, off_t *);
 int	crc32(int, uint32_t *, off_t *, off_t);
+uint32_t	crc32_buffer(uint32_t, const void *, size_t);
 __END_DECLS
 
 #endif
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "header.h"
+#include "fanout.h"
+
+/**
+  * Stream offset of the oldest byte some client has not been sent yet.
+  */
+static uint64_t oldest_unsent(fanout* out)
+{
+    uint64_t oldest = out->tail;
+    for (int i = 0; i<out->clients; i++)
+    {
+        oldest = MIN(oldest, out->sent[i]);
+    }
+
+    return oldest;
+}
+
+/**
+  * Grows the ring until 'needed' bytes fit, keeping the unsent part of the stream in place.
+  */
+static void grow(fanout* out, uint64_t oldest, size_t needed)
+{
+    size_t capacity = out->capacity;
+    while (capacity < needed)
+    {
+        capacity *= 2;
+    }
+
+    char* data = malloc(capacity);
+    if (data == NULL)
+    {
+        perror("Failed to grow control message buffer");
+        exit(-1);
+    }
+
+    /* Positions in the ring are stream offsets modulo the capacity, so copy byte ranges to their new slots */
+    for (uint64_t offset = oldest; offset < out->tail; )
+    {
+        size_t from = offset % out->capacity, to = offset % capacity;
+        size_t len = MIN(out->tail - offset, MIN(out->capacity - from, capacity - to));
+        memcpy(data + to, out->data + from, len);
+        offset += len;
+    }
+
+    free(out->data);
+    out->data = data;
+    out->capacity = capacity;
+}
+
+void fanout_init(fanout* out, int* sd, int clients)
+{
+    memset(out, 0, sizeof(fanout));
+    out->sd = sd;
+    out->clients = clients;
+    out->capacity = FANOUT_INITIAL_CAPACITY;
+    if ((out->data = malloc(out->capacity)) == NULL)
+    {
+        perror("Failed to allocate control message buffer");
+        exit(-1);
+    }
+}
+
+void fanout_append(fanout* out, const void* msg, size_t len)
+{
+    uint64_t oldest = oldest_unsent(out);
+    if (out->tail - oldest + len > out->capacity)
+    {
+        grow(out, oldest, out->tail - oldest + len);
+    }
+
+    for (size_t copied = 0; copied < len; )
+    {
+        size_t at = (out->tail + copied) % out->capacity;
+        size_t chunk = MIN(len - copied, out->capacity - at);
+        memcpy(out->data + at, (const char*) msg + copied, chunk);
+        copied += chunk;
+    }
+    out->tail += len;
+
+    fanout_flush(out);
+}
+
+int fanout_flush(fanout* out)
+{
+    out->pending = 0;
+    for (int i = 0; i<out->clients; i++)
+    {
+        uint64_t unsent = out->tail - out->sent[i];
+        if (unsent == 0)
+        {
+            continue;
+        }
+
+        /* At most two pieces, the end of the ring and the start if the stream wraps around */
+        size_t at = out->sent[i] % out->capacity;
+        struct iovec iov[2];
+        iov[0].iov_base = out->data + at;
+        iov[0].iov_len = MIN(unsent, out->capacity - at);
+        iov[1].iov_base = out->data;
+        iov[1].iov_len = unsent - iov[0].iov_len;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+
+        ssize_t nbytes = sendmsg(out->sd[i], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (nbytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("Failed to send control message");
+            exit(-1);
+        }
+
+        if (nbytes > 0)
+        {
+            out->sent[i] += nbytes;
+        }
+        if (out->sent[i] < out->tail)
+        {
+            out->pending++;
+        }
+    }
+
+    return out->pending;
+}
+
+void fanout_writefds(fanout* out, fd_set* writefds)
+{
+    for (int i = 0; out->pending > 0 && i<out->clients; i++)
+    {
+        if (out->sent[i] < out->tail)
+        {
+            FD_SET(out->sd[i], writefds);
+        }
+    }
+}
+
+void fanout_drain(fanout* out)
+{
+    while (fanout_flush(out) > 0)
+    {
+        fd_set writefds;
+        FD_ZERO(&writefds);
+        fanout_writefds(out, &writefds);
+        if (select(FD_SETSIZE, NULL, &writefds, NULL, NULL) < 0)
+        {
+            perror("Failed on selecting socket");
+            exit(-1);
+        }
+    }
+}
+
+void fanout_close(fanout* out)
+{
+    free(out->data);
+}
@@ -0,0 +1,61 @@
+#ifndef __MCAST_FANOUT_H
+#define __MCAST_FANOUT_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+/*
+ * Non-blocking fan-out of control messages to every client.
+ * Every client gets the same stream of messages, so each message is copied once into a shared
+ * ring buffer and each client only keeps how far into the stream it has been sent. Pending bytes
+ * go out with one non-blocking sendmsg() per client, so a client with a full socket buffer just
+ * falls behind in the stream instead of holding up the others.
+ */
+
+#define FANOUT_INITIAL_CAPACITY 4096
+
+typedef struct fanout
+{
+    int* sd;
+    int clients;
+
+    /* Ring buffer holding the stream from the slowest client's position up to 'tail' */
+    char* data;
+    size_t capacity;
+    uint64_t tail;
+    uint64_t sent[MAX_CONNECTIONS];
+
+    /* Clients with bytes still to send after the last flush */
+    int pending;
+
+} fanout;
+
+
+/**
+  * Starts an empty stream to the 'clients' sockets in 'sd'.
+  */
+void fanout_init(fanout* out, int* sd, int clients);
+
+/**
+  * Adds a message of 'len' bytes to the stream and sends as much of it as can be sent without blocking.
+  */
+void fanout_append(fanout* out, const void* msg, size_t len);
+
+/**
+  * Sends whatever each client can take without blocking. Returns the number of clients still behind.
+  */
+int fanout_flush(fanout* out);
+
+/**
+  * Adds the sockets of clients that are behind to 'writefds'.
+  */
+void fanout_writefds(fanout* out, fd_set* writefds);
+
+/**
+  * Blocks until every client has been sent the whole stream.
+  */
+void fanout_drain(fanout* out);
+
+void fanout_close(fanout* out);
+
+#endif
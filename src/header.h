@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +26,19 @@
 #define MULTICAST_GROUP "233.0.133.0"
 #define MAX_CONNECTIONS 100
 
+/* Each interface gets its own multicast lane on port MULTICAST_PORT + lane */
+#define MAX_LANES 8
+#define LANE_STRIPE 0   /* Packets are spread over the lanes by packet number */
+#define LANE_MIRROR 1   /* Every packet is sent on every lane */
+
+/* Ciphers data packets can be sealed with, see seal.h */
+#define SEAL_NONE 0
+#define SEAL_AES_GCM 1
+#define SEAL_CHACHA20_POLY1305 2
+#define SEAL_KEY_SIZE 32
+#define SEAL_SHARE_SIZE 32  /* X25519 public key */
+#define SEAL_TAG_SIZE 16
+
 #define WINDOW_SIZE 256
 #define BUFFER_SIZE 8192
 #define MAX_FILENAME 256
@@ -35,21 +49,28 @@
 #define RESEND_MSG 101
 #define NACK_MSG 111
 #define ACK_MSG 121
+#define READY_MSG 131   /* Client has joined the multicast group and can receive */
 
 /* Macros */
 #define MAX(x,y) (((x)>(y))?(x):(y))
 #define MIN(x,y) (((x)<(y))?(x):(y))
-#define WINDOW_OFFSET(window_number) ((window_number)*(WINDOW_SIZE)*(BUFFER_SIZE))
-#define WRITE_LOCATION(packet_number) ((packet_number)*(BUFFER_SIZE))
+#define ZERO_MAP_SET(map, n) ((map)[(n) / 8] |= 1 << ((n) % 8))
+#define ZERO_MAP_TEST(map, n) (((map)[(n) / 8] >> ((n) % 8)) & 1)
+#define WINDOW_OFFSET(window_number) ((int64_t)(window_number)*(WINDOW_SIZE)*(BUFFER_SIZE))
+#define WRITE_LOCATION(packet_number) ((int64_t)(packet_number)*(BUFFER_SIZE))
 
 /*
  * UDP packets 
+ * Sizes and offsets are 64-bit so files larger than 2GB can be sent.
+ * packet_number is the index within a window so it never exceeds WINDOW_SIZE.
  */
 typedef struct data
 {
-    int packet_number;
-    int packet_length;
-    int window_number;
+    int32_t packet_number;
+    int32_t packet_length;
+    int64_t window_number;
+    uint32_t checksum;  /* 0 in sealed sessions, the tag authenticates the packet instead */
+    uint8_t tag[SEAL_TAG_SIZE];
     char body[BUFFER_SIZE + 1];
 
 } data_packet;
@@ -59,23 +80,43 @@ typedef struct data
  */
 typedef struct header
 {
-    int filesize;
-    int packet_size;
-    int packet_count;
-    int checksum;
+    int64_t filesize;
+    int32_t packet_size;
+    int64_t packet_count;
+    int32_t checksum;   /* Whole file checksum if the server already knew it, otherwise 0 */
+    int32_t lanes;
+    int32_t lane_mode;
+    char group[IP_LENGTH];  /* Multicast group the lanes are sent to */
+    int32_t peer_repair;    /* Receivers repair each other before NACKing the server, see peer.h */
+    int32_t cipher;         /* SEAL_NONE, or the cipher data packets are sealed with */
+    uint8_t key_share[SEAL_SHARE_SIZE]; /* Server's public key for the key exchange, if sealed */
     char filename[MAX_FILENAME];
 
 } header_packet;
 
 typedef struct control
 {
-    int type;
-    int window_number;
-    off_t window_offset;
-    int checksum;
+    int32_t type;
+    int64_t window_number;
+    int64_t window_offset;
+    int32_t checksum;   /* WINDONE_MSG: window checksum, ACK_MSG: checksum of all windows ACKed so far */
+    uint8_t zero_packets[WINDOW_SIZE / 8];  /* WINDONE_MSG: packets that are all zeros and were not sent */
 
 } control_packet;
 
+/*
+ * Key exchange of a sealed session, straight after the header.
+ * The client sends its public key in 'share', the server replies with the session key
+ * sealed under the key both sides derive from the exchange.
+ */
+typedef struct key
+{
+    uint8_t share[SEAL_SHARE_SIZE];
+    uint8_t key[SEAL_KEY_SIZE];
+    uint8_t tag[SEAL_TAG_SIZE];
+
+} key_packet;
+
 typedef struct nack
 {
     int missing_packet_count;
@@ -83,6 +124,18 @@ typedef struct nack
 
 } nack_packet;
 
+/*
+ * Relay pipe records
+ * A relay client writes one for every window it has received and verified,
+ * the downstream server it started only sends windows it has a record for.
+ */
+typedef struct relay
+{
+    int64_t window_number;
+    int32_t checksum;
+
+} relay_window;
+
 
 
 /* Helper functions used by both client and server */
@@ -97,10 +150,58 @@ void print_header(header_packet header);
   * Uses the function in crc32.c to calculate the checksum of the given file descriptor.
   * To checksum the full file, give a start_offset of 0 and stop_offset of the end of the file.
   * Otherwise the exact chunk of the file to be checked can be specified by the start and stop offset.
+  * The file offset of 'fd' is not changed.
   */
 int get_checksum(int fd, off_t start_offset, off_t stop_offset);
 
 
+/**
+  * Adds a window checksum to the running checksum of the whole file.
+  * Start with a file_checksum of 0 and fold each window in order.
+  */
+int fold_checksum(int file_checksum, int window_checksum);
+
+
+/**
+  * Returns the CRC32 of 'len' bytes at 'buf' continuing from 'checksum', as crc32_buffer() does.
+  * Runs of zeros, such as holes in sparse files, are folded in without going through them byte by byte.
+  */
+uint32_t crc32_sparse(uint32_t checksum, const void* buf, size_t len);
+
+
+/**
+  * Returns 1 if all 'len' bytes at 'buf' are zero.
+  */
+int is_zero(const void* buf, size_t len);
+
+
+/**
+  * Returns the CRC32 of a data_packet's header fields and the first packet_length bytes of its body.
+  * The checksum field itself is not included.
+  */
+uint32_t get_packet_checksum(data_packet* packet);
+
+
+/**
+  * Returns 1 if 'packet' has a sane header and its checksum matches, otherwise 0.
+  * A packet that fails this check should be treated as lost.
+  */
+int verify_packet(data_packet* packet);
+
+
+/**
+  * As verify_packet(), for a packet whose body was received into 'body' instead of packet->body.
+  */
+int verify_packet_body(data_packet* packet, const void* body);
+
+
+/**
+  * Parses a comma separated list of interface names or IPv4 addresses into 'interfaces'.
+  * Returns the number of interfaces, exits if one can not be found or there are more than MAX_LANES.
+  */
+int parse_interfaces(const char* list, struct in_addr interfaces[]);
+
+
 /**
   * Helper function that returns the higher of the two given integers.
   */
@@ -0,0 +1,299 @@
+#include "header.h"
+#include "metrics.h"
+
+#include <linux/sock_diag.h>
+
+metrics g_metrics;
+
+void metrics_init(const char* role, const char* spec)
+{
+    memset(&g_metrics, 0, sizeof(metrics));
+    g_metrics.role = role;
+    g_metrics.start_us = metrics_now_us();
+
+    if (strncmp(spec, "json:", 5) == 0)
+    {
+        g_metrics.format = METRICS_JSON;
+    }
+    else if (strncmp(spec, "prom:", 5) == 0)
+    {
+        g_metrics.format = METRICS_PROM;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown metrics format '%s', expected json:<path> or prom:<path>\n", spec);
+        exit(-1);
+    }
+    strncpy(g_metrics.path, spec + 5, PATH_MAX - 1);
+
+    /* JSON lines are streamed as windows finish, the textfile is written once at the end */
+    if (g_metrics.format == METRICS_JSON)
+    {
+        if (strcmp(g_metrics.path, "-") == 0)
+        {
+            g_metrics.out = stdout;
+        }
+        else if ((g_metrics.out = fopen(g_metrics.path, "w")) == NULL)
+        {
+            perror("Failed to open metrics file");
+            exit(-1);
+        }
+    }
+}
+
+uint64_t metrics_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void hist_record(histogram* hist, uint64_t value)
+{
+    int bucket = 0;
+    while (bucket < HIST_BUCKETS - 1 && (1ULL << bucket) < value)
+    {
+        bucket++;
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += value;
+    hist->max = MAX(hist->max, value);
+}
+
+void metrics_window_start(void)
+{
+    memset(&g_metrics.window, 0, sizeof(window_stats));
+    g_metrics.window.start_us = metrics_now_us();
+}
+
+void metrics_window_end(int64_t window_number, int resend)
+{
+    window_stats* w = &g_metrics.window;
+    uint64_t total_us = metrics_now_us() - w->start_us;
+
+    g_metrics.windows++;
+    g_metrics.window_resends += resend;
+    g_metrics.repair_rounds += w->repair_rounds;
+    g_metrics.packets_nacked += w->packets_nacked;
+    g_metrics.packets_resent += w->packets_resent;
+    g_metrics.packets_corrupt += w->packets_corrupt;
+    hist_record(&g_metrics.window_send_us, w->send_us);
+    hist_record(&g_metrics.repair_rounds_per_window, w->repair_rounds);
+
+    if (g_metrics.format != METRICS_JSON)
+    {
+        return;
+    }
+
+    fprintf(g_metrics.out,
+        "{\"role\":\"%s\",\"event\":\"window\",\"window\":%" PRId64 ",\"total_us\":%" PRIu64 ",\"send_us\":%" PRIu64
+        ",\"checksum_us\":%" PRIu64 ",\"ack_latency_max_us\":%" PRIu64 ",\"bytes\":%" PRIu64
+        ",\"repair_rounds\":%d,\"packets_nacked\":%d,\"packets_resent\":%d,\"packets_corrupt\":%d,\"resend\":%d"
+        ",\"socket_drops\":%" PRIu64 "}\n",
+        g_metrics.role, window_number, total_us, w->send_us, w->checksum_us, w->ack_latency_max_us, w->bytes,
+        w->repair_rounds, w->packets_nacked, w->packets_resent, w->packets_corrupt, resend, g_metrics.socket_drops);
+}
+
+void metrics_checksum(uint64_t start_us)
+{
+    uint64_t elapsed = metrics_now_us() - start_us;
+
+    g_metrics.window.checksum_us += elapsed;
+    hist_record(&g_metrics.checksum_us, elapsed);
+}
+
+void metrics_ack_latency(uint64_t latency_us)
+{
+    g_metrics.window.ack_latency_max_us = MAX(g_metrics.window.ack_latency_max_us, latency_us);
+    hist_record(&g_metrics.ack_latency_us, latency_us);
+}
+
+void metrics_repair_rtt(uint64_t rtt_us)
+{
+    hist_record(&g_metrics.repair_rtt_us, rtt_us);
+}
+
+/**
+  * Reads the kernel drop counter of the UDP socket 'sd' from /proc/net/udp, for kernels without SO_MEMINFO.
+  * Returns 0 if it can not be found.
+  */
+static uint64_t proc_socket_drops(int sd)
+{
+    struct stat sd_stat;
+    if (fstat(sd, &sd_stat) < 0)
+    {
+        return 0;
+    }
+
+    FILE* udp = fopen("/proc/net/udp", "r");
+    if (udp == NULL)
+    {
+        return 0;
+    }
+
+    /* Each line ends with "... inode ref pointer drops" */
+    char line[512];
+    uint64_t drops = 0;
+    while (fgets(line, sizeof(line), udp) != NULL)
+    {
+        unsigned long inode;
+        unsigned long long line_drops;
+        if (sscanf(line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %lu %*s %*s %llu", &inode, &line_drops) == 2
+            && inode == sd_stat.st_ino)
+        {
+            drops = line_drops;
+            break;
+        }
+    }
+    fclose(udp);
+
+    return drops;
+}
+
+void metrics_socket_drops(const int* sd, int count)
+{
+    /* Nothing reads the counter without -m, and this runs inside the window barrier */
+    if (g_metrics.format == METRICS_NONE)
+    {
+        return;
+    }
+
+    g_metrics.socket_drops = 0;
+    for (int i = 0; i<count; i++)
+    {
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(meminfo);
+        if (getsockopt(sd[i], SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 && len > SK_MEMINFO_DROPS * sizeof(uint32_t))
+        {
+            g_metrics.socket_drops += meminfo[SK_MEMINFO_DROPS];
+        }
+        else
+        {
+            g_metrics.socket_drops += proc_socket_drops(sd[i]);
+        }
+    }
+}
+
+/**
+  * Writes 'hist' as a JSON object.
+  */
+static void json_histogram(FILE* out, const char* name, histogram* hist)
+{
+    fprintf(out, ",\"%s\":{\"count\":%" PRIu64 ",\"sum\":%" PRIu64 ",\"max\":%" PRIu64 ",\"buckets\":[",
+        name, hist->count, hist->sum, hist->max);
+    for (int i = 0; i<HIST_BUCKETS; i++)
+    {
+        fprintf(out, "%s%" PRIu64, (i == 0) ? "" : ",", hist->buckets[i]);
+    }
+    fprintf(out, "]}");
+}
+
+/**
+  * Writes 'hist' as a Prometheus histogram with cumulative buckets.
+  */
+static void prom_histogram(FILE* out, const char* name, histogram* hist)
+{
+    uint64_t cumulative = 0;
+
+    fprintf(out, "# TYPE mcast_%s histogram\n", name);
+    for (int i = 0; i<HIST_BUCKETS; i++)
+    {
+        cumulative += hist->buckets[i];
+        fprintf(out, "mcast_%s_bucket{role=\"%s\",le=\"%llu\"} %" PRIu64 "\n",
+            name, g_metrics.role, 1ULL << i, cumulative);
+    }
+    fprintf(out, "mcast_%s_bucket{role=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", name, g_metrics.role, hist->count);
+    fprintf(out, "mcast_%s_sum{role=\"%s\"} %" PRIu64 "\n", name, g_metrics.role, hist->sum);
+    fprintf(out, "mcast_%s_count{role=\"%s\"} %" PRIu64 "\n", name, g_metrics.role, hist->count);
+}
+
+static void prom_counter(FILE* out, const char* name, uint64_t value)
+{
+    fprintf(out, "# TYPE mcast_%s counter\n", name);
+    fprintf(out, "mcast_%s{role=\"%s\"} %" PRIu64 "\n", name, g_metrics.role, value);
+}
+
+void metrics_finish(void)
+{
+    if (g_metrics.format == METRICS_NONE)
+    {
+        return;
+    }
+
+    uint64_t elapsed_us = metrics_now_us() - g_metrics.start_us;
+    uint64_t bytes_per_sec = (elapsed_us > 0) ? g_metrics.bytes * 1000000 / elapsed_us : 0;
+
+    if (g_metrics.format == METRICS_JSON)
+    {
+        FILE* out = g_metrics.out;
+        fprintf(out,
+            "{\"role\":\"%s\",\"event\":\"summary\",\"elapsed_us\":%" PRIu64 ",\"bytes\":%" PRIu64
+            ",\"bytes_per_sec\":%" PRIu64 ",\"packets\":%" PRIu64 ",\"windows\":%" PRIu64 ",\"window_resends\":%" PRIu64
+            ",\"repair_rounds\":%" PRIu64 ",\"packets_nacked\":%" PRIu64 ",\"packets_resent\":%" PRIu64
+            ",\"packets_corrupt\":%" PRIu64 ",\"socket_drops\":%" PRIu64
+            ",\"peer_requested\":%" PRIu64 ",\"peer_repairs_sent\":%" PRIu64 ",\"peer_suppressed\":%" PRIu64
+            ",\"packets_sparse\":%" PRIu64,
+            g_metrics.role, elapsed_us, g_metrics.bytes, bytes_per_sec, g_metrics.packets, g_metrics.windows,
+            g_metrics.window_resends, g_metrics.repair_rounds, g_metrics.packets_nacked, g_metrics.packets_resent,
+            g_metrics.packets_corrupt, g_metrics.socket_drops,
+            g_metrics.peer_requested, g_metrics.peer_repairs_sent, g_metrics.peer_suppressed,
+            g_metrics.packets_sparse);
+        json_histogram(out, "window_send_us", &g_metrics.window_send_us);
+        json_histogram(out, "ack_latency_us", &g_metrics.ack_latency_us);
+        json_histogram(out, "checksum_us", &g_metrics.checksum_us);
+        json_histogram(out, "repair_rounds_per_window", &g_metrics.repair_rounds_per_window);
+        json_histogram(out, "repair_rtt_us", &g_metrics.repair_rtt_us);
+        fprintf(out, "}\n");
+
+        if (out == stdout)
+        {
+            fflush(out);
+        }
+        else
+        {
+            fclose(out);
+        }
+        return;
+    }
+
+    /* Write the textfile to a temporary name and rename so collectors never see a partial file */
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_metrics.path);
+
+    FILE* out = fopen(tmp_path, "w");
+    if (out == NULL)
+    {
+        perror("Failed to open metrics file");
+        return;
+    }
+
+    prom_counter(out, "bytes_total", g_metrics.bytes);
+    prom_counter(out, "packets_total", g_metrics.packets);
+    prom_counter(out, "windows_total", g_metrics.windows);
+    prom_counter(out, "window_resends_total", g_metrics.window_resends);
+    prom_counter(out, "repair_rounds_total", g_metrics.repair_rounds);
+    prom_counter(out, "packets_nacked_total", g_metrics.packets_nacked);
+    prom_counter(out, "packets_resent_total", g_metrics.packets_resent);
+    prom_counter(out, "packets_corrupt_total", g_metrics.packets_corrupt);
+    prom_counter(out, "socket_drops_total", g_metrics.socket_drops);
+    prom_counter(out, "peer_requested_total", g_metrics.peer_requested);
+    prom_counter(out, "peer_repairs_sent_total", g_metrics.peer_repairs_sent);
+    prom_counter(out, "peer_suppressed_total", g_metrics.peer_suppressed);
+    prom_counter(out, "packets_sparse_total", g_metrics.packets_sparse);
+    fprintf(out, "# TYPE mcast_bytes_per_second gauge\n");
+    fprintf(out, "mcast_bytes_per_second{role=\"%s\"} %" PRIu64 "\n", g_metrics.role, bytes_per_sec);
+    prom_histogram(out, "window_send_microseconds", &g_metrics.window_send_us);
+    prom_histogram(out, "ack_latency_microseconds", &g_metrics.ack_latency_us);
+    prom_histogram(out, "checksum_microseconds", &g_metrics.checksum_us);
+    prom_histogram(out, "repair_rounds_per_window", &g_metrics.repair_rounds_per_window);
+    prom_histogram(out, "repair_rtt_microseconds", &g_metrics.repair_rtt_us);
+    fclose(out);
+
+    if (rename(tmp_path, g_metrics.path) < 0)
+    {
+        perror("Failed to rename metrics file");
+    }
+}
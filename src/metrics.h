@@ -0,0 +1,134 @@
+#ifndef __MCAST_METRICS_H
+#define __MCAST_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/limits.h>
+
+/* Histogram buckets are powers of two, bucket i counts values <= 2^i */
+#define HIST_BUCKETS 32
+
+/* Export formats */
+#define METRICS_NONE 0
+#define METRICS_JSON 1
+#define METRICS_PROM 2
+
+typedef struct histogram
+{
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+
+} histogram;
+
+/*
+ * Stats for the window currently being transferred.
+ * Reset by metrics_window_start() and flushed by metrics_window_end().
+ */
+typedef struct window_stats
+{
+    uint64_t start_us;
+    uint64_t send_us;
+    uint64_t checksum_us;
+    uint64_t ack_latency_max_us;
+    uint64_t bytes;
+    int repair_rounds;
+    int packets_nacked;
+    int packets_resent;
+    int packets_corrupt;
+
+} window_stats;
+
+typedef struct metrics
+{
+    int format;
+    char path[PATH_MAX];
+    FILE* out;
+    const char* role;
+    uint64_t start_us;
+
+    /* Counters for the whole transfer */
+    uint64_t windows;
+    uint64_t window_resends;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t repair_rounds;
+    uint64_t packets_nacked;
+    uint64_t packets_resent;
+    uint64_t packets_corrupt;
+    uint64_t socket_drops;
+
+    /* Peer repair, see peer.h */
+    uint64_t peer_requested;
+    uint64_t peer_repairs_sent;
+    uint64_t peer_suppressed;
+
+    /* Packets that were all zeros, so they were left out and became holes */
+    uint64_t packets_sparse;
+
+    histogram window_send_us;
+    histogram ack_latency_us;
+    histogram checksum_us;
+    histogram repair_rounds_per_window;
+    histogram repair_rtt_us;
+
+    window_stats window;
+
+} metrics;
+
+extern metrics g_metrics;
+
+
+/**
+  * Enables metrics for 'role' ("server" or "client").
+  * 'spec' is "json:<path>" for JSON lines or "prom:<path>" for a Prometheus textfile.
+  * A path of "-" writes JSON lines to stdout.
+  */
+void metrics_init(const char* role, const char* spec);
+
+/**
+  * Returns a monotonic timestamp in microseconds.
+  */
+uint64_t metrics_now_us(void);
+
+/**
+  * Adds 'value' to the histogram 'hist'.
+  */
+void hist_record(histogram* hist, uint64_t value);
+
+/**
+  * Marks the start and end of a window. metrics_window_end() folds the
+  * current window_stats into the totals and writes a JSON line if enabled.
+  * 'resend' is set if the window is going to be sent again.
+  */
+void metrics_window_start(void);
+void metrics_window_end(int64_t window_number, int resend);
+
+/**
+  * Records the time taken by a checksum which started at 'start_us'.
+  */
+void metrics_checksum(uint64_t start_us);
+
+/**
+  * Records the latency of an ACK from a single receiver.
+  */
+void metrics_ack_latency(uint64_t latency_us);
+
+/**
+  * Records the time from sending a NACK to receiving the first repair for it.
+  */
+void metrics_repair_rtt(uint64_t rtt_us);
+
+/**
+  * Sets socket_drops to the sum of the kernel drop counters of the 'count' UDP sockets in 'sd'.
+  * Does nothing unless metrics are being written.
+  */
+void metrics_socket_drops(const int* sd, int count);
+
+/**
+  * Writes the summary (JSON line or Prometheus textfile) and closes the output.
+  */
+void metrics_finish(void);
+
+#endif
@@ -0,0 +1,264 @@
+#include <stddef.h>
+
+#include "header.h"
+#include "peer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "seal.h"
+
+/**
+  * Returns a random delay in [d, 2d], doubled for every earlier round.
+  */
+static uint64_t random_delay(peer_state* peer, int rounds)
+{
+    return (peer->delay_us + (uint64_t) rand() % (peer->delay_us + 1)) << rounds;
+}
+
+void peer_open(peer_state* peer, const char* group, struct in_addr interface, struct sockaddr_in* lane_address,
+    int lanes, int lane_mode, int fd)
+{
+    memset(peer, 0, sizeof(peer_state));
+    peer->id = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+    peer->lane_address = lane_address;
+    peer->lanes = lanes;
+    peer->lane_mode = lane_mode;
+    peer->fd = fd;
+    peer->window_number = -1;
+
+    if ((peer->sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("Failed to create peer UDP socket");
+        exit(-1);
+    }
+
+    /* Every receiver on this host shares the request port */
+    u_int yes = 1;
+    if (setsockopt(peer->sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
+    {
+        perror("Failed to reuse port address");
+        exit(-1);
+    }
+
+    memset(&peer->address, 0, sizeof(struct sockaddr_in));
+    peer->address.sin_family = AF_INET;
+    peer->address.sin_addr.s_addr = inet_addr(group);
+    peer->address.sin_port = PEER_PORT;
+
+    if (bind(peer->sd, (struct sockaddr*) &peer->address, sizeof(struct sockaddr_in)) < 0)
+    {
+        perror("Failed to bind peer socket");
+        exit(-1);
+    }
+
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(group);
+    mreq.imr_interface = interface;
+    if (setsockopt(peer->sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+        perror("Failed to add to peer multicast group");
+        exit(-1);
+    }
+
+    if (interface.s_addr != INADDR_ANY
+        && setsockopt(peer->sd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(struct in_addr)) < 0)
+    {
+        perror("Failed to set peer multicast interface");
+        exit(-1);
+    }
+}
+
+void peer_window_start(peer_state* peer, int64_t window_number, uint64_t rtt_us)
+{
+    peer->window_number = window_number;
+    peer->delay_us = (rtt_us > 0) ? MAX(rtt_us, (uint64_t) PEER_MIN_DELAY_US) : PEER_DEFAULT_DELAY_US;
+    peer->request_due = 0;
+    peer->request_rounds = 0;
+    memset(peer->heard, 0, sizeof(peer->heard));
+    memset(peer->repair_due, 0, sizeof(peer->repair_due));
+    memset(peer->repaired_at, 0, sizeof(peer->repaired_at));
+}
+
+void peer_request_missing(peer_state* peer)
+{
+    peer->request_due = metrics_now_us() + random_delay(peer, 0);
+}
+
+void peer_recv(peer_state* peer, int* missing_packet_map)
+{
+    peer_request request;
+    ssize_t nbytes = recv(peer->sd, &request, sizeof(peer_request), 0);
+
+    /* Our own requests are looped back, and late ones can be for a window that is already done */
+    if (nbytes < (ssize_t) offsetof(peer_request, missing_packets) || request.sender == peer->id
+        || request.window_number != peer->window_number)
+    {
+        return;
+    }
+
+    if (request.missing_packet_count < 0)
+    {
+        return;
+    }
+
+    /* Only trust as many packet numbers as actually arrived */
+    int received = (nbytes - offsetof(peer_request, missing_packets)) / sizeof(int32_t);
+    int count = MIN(request.missing_packet_count, received);
+    TRACE(TRACE_PEER_REQUEST_RECV, request.window_number, count);
+
+    uint64_t now = metrics_now_us();
+    for (int i = 0; i<count; i++)
+    {
+        int packet_number = request.missing_packets[i];
+        if (packet_number < 0 || packet_number >= WINDOW_SIZE)
+        {
+            continue;
+        }
+
+        if (missing_packet_map[packet_number] == 0)
+        {
+            peer->heard[packet_number] = 1;
+        }
+        else if (peer->repair_due[packet_number] == 0
+            && (peer->repaired_at[packet_number] == 0 || now > peer->repaired_at[packet_number] + 3 * peer->delay_us))
+        {
+            peer->repair_due[packet_number] = now + random_delay(peer, 0);
+        }
+    }
+}
+
+void peer_repair_seen(peer_state* peer, int packet_number)
+{
+    peer->repaired_at[packet_number] = metrics_now_us();
+    if (peer->repair_due[packet_number] != 0)
+    {
+        TRACE(TRACE_PEER_REPAIR_SUPPRESS, peer->window_number, packet_number);
+        peer->repair_due[packet_number] = 0;
+        g_metrics.peer_suppressed++;
+    }
+}
+
+uint64_t peer_next_timer(peer_state* peer)
+{
+    uint64_t next = peer->request_due;
+    for (int i = 0; i<WINDOW_SIZE; i++)
+    {
+        if (peer->repair_due[i] != 0 && (next == 0 || peer->repair_due[i] < next))
+        {
+            next = peer->repair_due[i];
+        }
+    }
+
+    return next;
+}
+
+/**
+  * Multicasts a request for every missing packet no other receiver has asked for since the last round.
+  */
+static void send_request(peer_state* peer, int* missing_packet_map)
+{
+    /* Zeroed so the padding after 'sender' never carries stack memory onto the group */
+    peer_request request;
+    memset(&request, 0, sizeof(peer_request));
+    request.sender = peer->id;
+    request.window_number = peer->window_number;
+
+    for (int i = 0; i<WINDOW_SIZE; i++)
+    {
+        if (missing_packet_map[i] == 0 && !peer->heard[i])
+        {
+            request.missing_packets[request.missing_packet_count++] = i;
+        }
+    }
+    memset(peer->heard, 0, sizeof(peer->heard));
+
+    if (request.missing_packet_count == 0)
+    {
+        g_metrics.peer_suppressed++;
+        return;
+    }
+
+    size_t len = offsetof(peer_request, missing_packets) + request.missing_packet_count * sizeof(int32_t);
+    TRACE(TRACE_PEER_REQUEST_SEND, peer->window_number, request.missing_packet_count);
+    if (sendto(peer->sd, &request, len, 0, (struct sockaddr*) &peer->address, sizeof(struct sockaddr_in)) < 0)
+    {
+        perror("Failed to send peer request");
+        exit(-1);
+    }
+    g_metrics.peer_requested += request.missing_packet_count;
+}
+
+/**
+  * Reads 'packet_number' back from the destination file and multicasts it as the server would.
+  */
+static void send_repair(peer_state* peer, int packet_number)
+{
+    data_packet packet;
+    memset(&packet, 0, sizeof(data_packet));
+
+    ssize_t nbytes = pread(peer->fd, packet.body, BUFFER_SIZE,
+        WINDOW_OFFSET(peer->window_number) + WRITE_LOCATION(packet_number));
+    if (nbytes < 0)
+    {
+        perror("Failed to read packet for peer repair");
+        exit(-1);
+    }
+
+    packet.packet_number = packet_number;
+    packet.packet_length = nbytes;
+    packet.window_number = peer->window_number;
+    if (peer->seal != NULL)
+    {
+        seal_packets(peer->seal, &packet, 1);
+    }
+    else
+    {
+        packet.checksum = get_packet_checksum(&packet);
+    }
+
+    TRACE(TRACE_PEER_REPAIR_SEND, peer->window_number, packet_number);
+    for (int lane = 0; lane<peer->lanes; lane++)
+    {
+        if (peer->lane_mode == LANE_MIRROR || packet_number % peer->lanes == lane)
+        {
+            if (sendto(peer->sd, &packet, sizeof(data_packet), 0, (struct sockaddr*) &peer->lane_address[lane],
+                sizeof(struct sockaddr_in)) < 0)
+            {
+                perror("Failed to send peer repair");
+                exit(-1);
+            }
+        }
+    }
+    g_metrics.peer_repairs_sent++;
+}
+
+void peer_run_timers(peer_state* peer, int* missing_packet_map)
+{
+    uint64_t now = metrics_now_us();
+
+    if (peer->request_due != 0 && peer->request_due <= now)
+    {
+        send_request(peer, missing_packet_map);
+        peer->request_rounds++;
+        peer->request_due = now + random_delay(peer, peer->request_rounds);
+    }
+
+    for (int i = 0; i<WINDOW_SIZE; i++)
+    {
+        if (peer->repair_due[i] != 0 && peer->repair_due[i] <= now)
+        {
+            peer->repair_due[i] = 0;
+            peer->repaired_at[i] = now;
+            send_repair(peer, i);
+        }
+    }
+}
+
+int peer_fallback(peer_state* peer)
+{
+    return peer->request_rounds >= PEER_FALLBACK_ROUNDS;
+}
+
+void peer_close(peer_state* peer)
+{
+    close(peer->sd);
+}
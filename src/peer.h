@@ -0,0 +1,112 @@
+#ifndef __MCAST_PEER_H
+#define __MCAST_PEER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * Peer-assisted repair between receivers, after SRM (Floyd et al., "A Reliable Multicast Framework
+ * for Light-weight Sessions and Application Level Framing").
+ *
+ * A receiver missing packets multicasts a request to the other receivers after a random delay,
+ * and skips it if another receiver asked for the same packets first. Any receiver that has a
+ * requested packet multicasts it back after a random delay, unless it sees someone else's repair
+ * first. The server is only NACKed once PEER_FALLBACK_ROUNDS requests have gone unanswered.
+ *
+ * Delays are drawn from [d, 2d] where d is the receiver's round trip time to the server.
+ * Requests for a packet repaired in the last 3d are ignored, they crossed with the repair.
+ */
+
+/* Requests go to the session's group on the port after the last possible lane */
+#define PEER_PORT (MULTICAST_PORT + MAX_LANES)
+
+/* d before there is a round trip sample, and its lower bound */
+#define PEER_DEFAULT_DELAY_US 1000
+#define PEER_MIN_DELAY_US 200
+
+/* Request timers that fire without the window being completed before falling back to the server */
+#define PEER_FALLBACK_ROUNDS 3
+
+typedef struct peer_request
+{
+    uint32_t sender;
+    int64_t window_number;
+    int32_t missing_packet_count;
+    int32_t missing_packets[WINDOW_SIZE];
+
+} peer_request;
+
+typedef struct peer_state
+{
+    int sd;
+    uint32_t id;
+    struct sockaddr_in address;
+
+    /* Repairs are sent to the data lanes so they arrive like any other packet */
+    struct sockaddr_in* lane_address;
+    int lanes;
+    int lane_mode;
+
+    /* Destination file repairs are read from */
+    int fd;
+
+    /* Repairs are sealed with this in sealed sessions, NULL otherwise */
+    struct seal_state* seal;
+
+    int64_t window_number;
+    uint64_t delay_us;
+    uint64_t request_due;
+    int request_rounds;
+    int heard[WINDOW_SIZE];
+    uint64_t repair_due[WINDOW_SIZE];
+    uint64_t repaired_at[WINDOW_SIZE];
+
+} peer_state;
+
+
+/**
+  * Joins the peer request group 'group' on 'interface' and sends requests and repairs from it.
+  * Repairs of packets from 'fd' go to 'lane_address', in the same way the server sends them.
+  */
+void peer_open(peer_state* peer, const char* group, struct in_addr interface, struct sockaddr_in* lane_address,
+    int lanes, int lane_mode, int fd);
+
+/**
+  * Drops all timers and starts tracking 'window_number', with 'rtt_us' as d (0 if unknown).
+  */
+void peer_window_start(peer_state* peer, int64_t window_number, uint64_t rtt_us);
+
+/**
+  * Starts the request timer once the server has finished sending the window and packets are missing.
+  */
+void peer_request_missing(peer_state* peer);
+
+/**
+  * Reads a request from the peer socket.
+  * Packets we have are scheduled for repair, packets we are missing too count as already requested.
+  */
+void peer_recv(peer_state* peer, int* missing_packet_map);
+
+/**
+  * Called for a duplicate of a packet we have, cancels our own repair of it if one is pending.
+  */
+void peer_repair_seen(peer_state* peer, int packet_number);
+
+/**
+  * Returns the time in microseconds of the next timer, or 0 if none are pending.
+  */
+uint64_t peer_next_timer(peer_state* peer);
+
+/**
+  * Sends any requests and repairs that are due.
+  */
+void peer_run_timers(peer_state* peer, int* missing_packet_map);
+
+/**
+  * Returns 1 once the peers have had PEER_FALLBACK_ROUNDS chances and the server should be NACKed.
+  */
+int peer_fallback(peer_state* peer);
+
+void peer_close(peer_state* peer);
+
+#endif
@@ -0,0 +1,40 @@
+#include "header.h"
+#include "rto.h"
+
+void rto_init(rto_estimator* rto)
+{
+    memset(rto, 0, sizeof(rto_estimator));
+    rto->rto_us = RTO_INITIAL_US;
+}
+
+void rto_sample(rto_estimator* rto, uint64_t rtt_us)
+{
+    if (!rto->has_sample)
+    {
+        rto->srtt_us = rtt_us;
+        rto->rttvar_us = rtt_us / 2;
+        rto->has_sample = 1;
+    }
+    else
+    {
+        /* RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R */
+        uint64_t delta = (rto->srtt_us > rtt_us) ? rto->srtt_us - rtt_us : rtt_us - rto->srtt_us;
+        rto->rttvar_us = (3 * rto->rttvar_us + delta) / 4;
+        rto->srtt_us = (7 * rto->srtt_us + rtt_us) / 8;
+    }
+
+    rto->rto_us = MIN(MAX(rto->srtt_us + 4 * rto->rttvar_us, (uint64_t) RTO_MIN_US), (uint64_t) RTO_MAX_US);
+    rto->backoff = 0;
+}
+
+void rto_backoff(rto_estimator* rto)
+{
+    rto->backoff = MIN(rto->backoff + 1, RTO_MAX_BACKOFF);
+}
+
+uint64_t rto_timeout_us(rto_estimator* rto)
+{
+    uint64_t timeout = MIN(rto->rto_us << rto->backoff, (uint64_t) RTO_MAX_US);
+
+    return timeout + (uint64_t) rand() % (timeout / 2 + 1);
+}
@@ -0,0 +1,51 @@
+#ifndef __MCAST_RTO_H
+#define __MCAST_RTO_H
+
+#include <stdint.h>
+
+/*
+ * Retransmission timeout estimator for NACKs, following RFC 6298.
+ * Samples are the time from sending a NACK to receiving the first repair for it.
+ */
+
+#define RTO_INITIAL_US 100000
+#define RTO_MIN_US 1000
+#define RTO_MAX_US 2000000
+
+/* Maximum number of times the timeout is doubled without a new sample */
+#define RTO_MAX_BACKOFF 6
+
+typedef struct rto_estimator
+{
+    uint64_t srtt_us;
+    uint64_t rttvar_us;
+    uint64_t rto_us;
+    int backoff;
+    int has_sample;
+
+} rto_estimator;
+
+
+/**
+  * Initialises 'rto' with RTO_INITIAL_US and no samples.
+  */
+void rto_init(rto_estimator* rto);
+
+/**
+  * Updates SRTT, RTTVAR and the timeout with a new round trip sample, and clears any backoff.
+  * Samples must not be taken from retransmitted NACKs (Karn's algorithm).
+  */
+void rto_sample(rto_estimator* rto, uint64_t rtt_us);
+
+/**
+  * Doubles the timeout after it expired, up to RTO_MAX_BACKOFF times and RTO_MAX_US.
+  */
+void rto_backoff(rto_estimator* rto);
+
+/**
+  * Returns the current timeout with up to 50% random jitter added,
+  * so receivers that lost the same packets do not all NACK in the same instant.
+  */
+uint64_t rto_timeout_us(rto_estimator* rto);
+
+#endif
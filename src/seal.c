@@ -0,0 +1,285 @@
+#include <stddef.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#include "header.h"
+#include "seal.h"
+
+/* Nonces are 96 bits, the packet's index in the file goes in the low 64 */
+#define SEAL_NONCE_SIZE 12
+
+/* HKDF info, followed by the server's and the client's public keys */
+#define SEAL_KDF_LABEL "mfd session key"
+
+/* Authenticated with the body: packet_number, packet_length and window_number */
+#define SEAL_AAD_SIZE offsetof(data_packet, checksum)
+
+/**
+  * Prints the OpenSSL error queue after 'message' and exits.
+  */
+static void seal_fail(const char* message)
+{
+    fprintf(stderr, "%s\n", message);
+    ERR_print_errors_fp(stderr);
+    exit(-1);
+}
+
+static const EVP_CIPHER* evp_cipher(int cipher)
+{
+    return (cipher == SEAL_CHACHA20_POLY1305) ? EVP_chacha20_poly1305() : EVP_aes_256_gcm();
+}
+
+/**
+  * Nonce of the packet at 'packet_number' in 'window_number'.
+  */
+static void packet_nonce(int64_t window_number, int packet_number, uint8_t nonce[SEAL_NONCE_SIZE])
+{
+    uint64_t index = (uint64_t) window_number * WINDOW_SIZE + packet_number;
+    memset(nonce, 0, SEAL_NONCE_SIZE);
+    memcpy(nonce + SEAL_NONCE_SIZE - sizeof(index), &index, sizeof(index));
+}
+
+int seal_cipher(const char* name)
+{
+    if (strcmp(name, "aes") == 0)
+    {
+        return SEAL_AES_GCM;
+    }
+    if (strcmp(name, "chacha") == 0)
+    {
+        return SEAL_CHACHA20_POLY1305;
+    }
+
+    fprintf(stderr, "Unknown cipher '%s', use aes or chacha\n", name);
+    exit(-1);
+}
+
+void seal_read_secret(const char* path, char secret[SEAL_MAX_SECRET + 1])
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror("Failed to open secret file");
+        exit(-1);
+    }
+
+    size_t len = fread(secret, 1, SEAL_MAX_SECRET, file);
+    fclose(file);
+
+    /* The trailing newline an editor leaves is not part of the secret */
+    while (len > 0 && (secret[len - 1] == '\n' || secret[len - 1] == '\r'))
+    {
+        len--;
+    }
+    secret[len] = '\0';
+
+    if (len == 0)
+    {
+        fprintf(stderr, "Secret file '%s' is empty\n", path);
+        exit(-1);
+    }
+}
+
+void seal_init(seal_state* seal, int cipher, const uint8_t* key)
+{
+    memset(seal, 0, sizeof(seal_state));
+    seal->cipher = cipher;
+
+    if (key != NULL)
+    {
+        memcpy(seal->key, key, SEAL_KEY_SIZE);
+    }
+    else if (RAND_bytes(seal->key, SEAL_KEY_SIZE) != 1)
+    {
+        seal_fail("Failed to generate session key");
+    }
+
+    if ((seal->seal_ctx = EVP_CIPHER_CTX_new()) == NULL || (seal->open_ctx = EVP_CIPHER_CTX_new()) == NULL
+        || EVP_EncryptInit_ex(seal->seal_ctx, evp_cipher(cipher), NULL, seal->key, NULL) != 1
+        || EVP_DecryptInit_ex(seal->open_ctx, evp_cipher(cipher), NULL, seal->key, NULL) != 1)
+    {
+        seal_fail("Failed to set up cipher");
+    }
+}
+
+void seal_packets(seal_state* seal, data_packet* packets, int count)
+{
+    uint8_t nonce[SEAL_NONCE_SIZE];
+    int len;
+
+    for (int i = 0; i<count; i++)
+    {
+        data_packet* packet = &packets[i];
+        uint8_t* body = (uint8_t*) packet->body;
+        packet->checksum = 0;
+        packet_nonce(packet->window_number, packet->packet_number, nonce);
+
+        if (EVP_EncryptInit_ex(seal->seal_ctx, NULL, NULL, NULL, nonce) != 1
+            || EVP_EncryptUpdate(seal->seal_ctx, NULL, &len, (uint8_t*) packet, SEAL_AAD_SIZE) != 1
+            || EVP_EncryptUpdate(seal->seal_ctx, body, &len, body, packet->packet_length) != 1
+            || EVP_EncryptFinal_ex(seal->seal_ctx, body + len, &len) != 1
+            || EVP_CIPHER_CTX_ctrl(seal->seal_ctx, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG_SIZE, packet->tag) != 1)
+        {
+            seal_fail("Failed to seal packet");
+        }
+    }
+}
+
+int seal_open(seal_state* seal, data_packet* packet, void* body)
+{
+    /* Check the header first so a forged length is never used to decrypt */
+    if (packet->packet_number < 0 || packet->packet_number >= WINDOW_SIZE
+        || packet->packet_length < 0 || packet->packet_length > BUFFER_SIZE
+        || packet->window_number < 0)
+    {
+        return 0;
+    }
+
+    uint8_t nonce[SEAL_NONCE_SIZE];
+    packet_nonce(packet->window_number, packet->packet_number, nonce);
+
+    int len;
+    return EVP_DecryptInit_ex(seal->open_ctx, NULL, NULL, NULL, nonce) == 1
+        && EVP_DecryptUpdate(seal->open_ctx, NULL, &len, (uint8_t*) packet, SEAL_AAD_SIZE) == 1
+        && EVP_DecryptUpdate(seal->open_ctx, body, &len, body, packet->packet_length) == 1
+        && EVP_CIPHER_CTX_ctrl(seal->open_ctx, EVP_CTRL_AEAD_SET_TAG, SEAL_TAG_SIZE, packet->tag) == 1
+        && EVP_DecryptFinal_ex(seal->open_ctx, (uint8_t*) body + len, &len) == 1;
+}
+
+void seal_close(seal_state* seal)
+{
+    EVP_CIPHER_CTX_free(seal->seal_ctx);
+    EVP_CIPHER_CTX_free(seal->open_ctx);
+    OPENSSL_cleanse(seal->key, SEAL_KEY_SIZE);
+}
+
+EVP_PKEY* seal_keypair(uint8_t share[SEAL_SHARE_SIZE])
+{
+    EVP_PKEY* pkey = NULL;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    size_t len = SEAL_SHARE_SIZE;
+
+    if (ctx == NULL || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx, &pkey) <= 0
+        || EVP_PKEY_get_raw_public_key(pkey, share, &len) <= 0)
+    {
+        seal_fail("Failed to generate key exchange key pair");
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
+/**
+  * Derives the key the session key is sealed with, from the X25519 shared secret of 'own' and 'peer_share'.
+  * Both public keys go into the derivation so the key belongs to this exchange only,
+  * and the shared secret is the HKDF salt so the key can't be derived without it.
+  */
+static void derive_key(EVP_PKEY* own, const uint8_t peer_share[SEAL_SHARE_SIZE],
+    const uint8_t server_share[SEAL_SHARE_SIZE], const uint8_t client_share[SEAL_SHARE_SIZE],
+    const char* secret, uint8_t key[SEAL_KEY_SIZE])
+{
+    uint8_t shared[SEAL_SHARE_SIZE];
+    size_t shared_len = sizeof(shared);
+
+    EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_share, SEAL_SHARE_SIZE);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(own, NULL);
+    if (peer == NULL || ctx == NULL || EVP_PKEY_derive_init(ctx) <= 0 || EVP_PKEY_derive_set_peer(ctx, peer) <= 0
+        || EVP_PKEY_derive(ctx, shared, &shared_len) <= 0)
+    {
+        seal_fail("Failed key exchange");
+    }
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+
+    uint8_t info[sizeof(SEAL_KDF_LABEL) + 2 * SEAL_SHARE_SIZE];
+    memcpy(info, SEAL_KDF_LABEL, sizeof(SEAL_KDF_LABEL));
+    memcpy(info + sizeof(SEAL_KDF_LABEL), server_share, SEAL_SHARE_SIZE);
+    memcpy(info + sizeof(SEAL_KDF_LABEL) + SEAL_SHARE_SIZE, client_share, SEAL_SHARE_SIZE);
+
+    size_t key_len = SEAL_KEY_SIZE;
+    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (ctx == NULL || EVP_PKEY_derive_init(ctx) <= 0 || EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) <= 0
+        || (secret[0] != '\0' && EVP_PKEY_CTX_set1_hkdf_salt(ctx, (const uint8_t*) secret, strlen(secret)) <= 0)
+        || EVP_PKEY_CTX_set1_hkdf_key(ctx, shared, shared_len) <= 0
+        || EVP_PKEY_CTX_add1_hkdf_info(ctx, info, sizeof(info)) <= 0
+        || EVP_PKEY_derive(ctx, key, &key_len) <= 0)
+    {
+        seal_fail("Failed to derive key");
+    }
+    EVP_PKEY_CTX_free(ctx);
+    OPENSSL_cleanse(shared, sizeof(shared));
+}
+
+/**
+  * Seals or opens the session key in 'packet' in place under 'key'.
+  * Each derived key only ever seals one session key, so the nonce is always zero.
+  */
+static int crypt_key(int cipher, const uint8_t key[SEAL_KEY_SIZE], key_packet* packet, int encrypt)
+{
+    uint8_t nonce[SEAL_NONCE_SIZE] = { 0 };
+    int len, ok;
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL || EVP_CipherInit_ex(ctx, evp_cipher(cipher), NULL, key, nonce, encrypt) != 1)
+    {
+        seal_fail("Failed to set up cipher");
+    }
+
+    if (encrypt)
+    {
+        ok = EVP_EncryptUpdate(ctx, packet->key, &len, packet->key, SEAL_KEY_SIZE) == 1
+            && EVP_EncryptFinal_ex(ctx, packet->key + len, &len) == 1
+            && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG_SIZE, packet->tag) == 1;
+    }
+    else
+    {
+        ok = EVP_DecryptUpdate(ctx, packet->key, &len, packet->key, SEAL_KEY_SIZE) == 1
+            && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, SEAL_TAG_SIZE, packet->tag) == 1
+            && EVP_DecryptFinal_ex(ctx, packet->key + len, &len) == 1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+void seal_wrap_key(seal_state* seal, EVP_PKEY* own, key_packet* request, const char* secret, key_packet* reply)
+{
+    uint8_t server_share[SEAL_SHARE_SIZE], key[SEAL_KEY_SIZE];
+    size_t len = SEAL_SHARE_SIZE;
+    if (EVP_PKEY_get_raw_public_key(own, server_share, &len) <= 0)
+    {
+        seal_fail("Failed to read key exchange public key");
+    }
+
+    derive_key(own, request->share, server_share, request->share, secret, key);
+
+    memset(reply, 0, sizeof(key_packet));
+    memcpy(reply->key, seal->key, SEAL_KEY_SIZE);
+    if (!crypt_key(seal->cipher, key, reply, 1))
+    {
+        seal_fail("Failed to seal session key");
+    }
+    OPENSSL_cleanse(key, SEAL_KEY_SIZE);
+}
+
+int seal_unwrap_key(int cipher, EVP_PKEY* own, const uint8_t server_share[SEAL_SHARE_SIZE], key_packet* reply,
+    const char* secret, uint8_t key[SEAL_KEY_SIZE])
+{
+    uint8_t client_share[SEAL_SHARE_SIZE], derived[SEAL_KEY_SIZE];
+    size_t len = SEAL_SHARE_SIZE;
+    if (EVP_PKEY_get_raw_public_key(own, client_share, &len) <= 0)
+    {
+        seal_fail("Failed to read key exchange public key");
+    }
+
+    derive_key(own, server_share, server_share, client_share, secret, derived);
+    int ok = crypt_key(cipher, derived, reply, 0);
+    OPENSSL_cleanse(derived, SEAL_KEY_SIZE);
+
+    if (ok)
+    {
+        memcpy(key, reply->key, SEAL_KEY_SIZE);
+    }
+    return ok;
+}
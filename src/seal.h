@@ -0,0 +1,85 @@
+#ifndef __MCAST_SEAL_H
+#define __MCAST_SEAL_H
+
+#include <stdint.h>
+#include <openssl/evp.h>
+
+/*
+ * Authenticated encryption of data packets with AES-256-GCM or ChaCha20-Poly1305.
+ * OpenSSL picks the fastest implementation the CPU has (AES-NI, VAES, AVX2), so this costs a
+ * few percent of a core at line rate. Run out/sealbench to measure it against plain packets.
+ *
+ * The body is encrypted and the packet, window number and length are authenticated with it, so a
+ * host on the group without the session key can't get a packet written to the destination file.
+ * The nonce is the packet's position in the file. A repair seals the same bytes under the same
+ * nonce, so it is the same datagram as the original and never reuses a nonce for other data.
+ *
+ * Every session has its own random key. Each client gets it over its TCP connection, sealed with
+ * a key derived from an X25519 exchange. A shared secret (-k) is mixed into that derivation so only
+ * clients holding it can open the session key. Without one the exchange only keeps out hosts that
+ * can't intercept the TCP connection.
+ */
+
+/* Longest shared secret read from a -k file */
+#define SEAL_MAX_SECRET 256
+
+typedef struct seal_state
+{
+    int cipher;
+    uint8_t key[SEAL_KEY_SIZE];
+
+    /* Keep the expanded key between packets, only the nonce changes */
+    EVP_CIPHER_CTX* seal_ctx;
+    EVP_CIPHER_CTX* open_ctx;
+
+} seal_state;
+
+
+/**
+  * Parses a cipher name, "aes" or "chacha". Exits if it is neither.
+  */
+int seal_cipher(const char* name);
+
+/**
+  * Reads the shared secret from the file at 'path' into 'secret'.
+  */
+void seal_read_secret(const char* path, char secret[SEAL_MAX_SECRET + 1]);
+
+/**
+  * Starts sealing and opening packets with 'cipher' under 'key', or a new random key if 'key' is NULL.
+  */
+void seal_init(seal_state* seal, int cipher, const uint8_t* key);
+
+/**
+  * Seals 'count' packets in place, clearing their checksums.
+  * The packets of a window are sealed in one call so the key stays in cache.
+  */
+void seal_packets(seal_state* seal, data_packet* packets, int count);
+
+/**
+  * Checks the header of 'packet' and opens its body, which was received into 'body'.
+  * The body is decrypted in place. Returns 1 if the tag matches, otherwise 0 and the body is garbage.
+  */
+int seal_open(seal_state* seal, data_packet* packet, void* body);
+
+void seal_close(seal_state* seal);
+
+/**
+  * Creates an X25519 key pair for the key exchange and stores its public key in 'share'.
+  */
+EVP_PKEY* seal_keypair(uint8_t share[SEAL_SHARE_SIZE]);
+
+/**
+  * Seals the session key of 'seal' into 'reply' for the client that sent 'request'.
+  * 'own' is the server's key pair and 'secret' the shared secret, empty if there is none.
+  */
+void seal_wrap_key(seal_state* seal, EVP_PKEY* own, key_packet* request, const char* secret, key_packet* reply);
+
+/**
+  * Opens the session key in 'reply' with the key derived from 'own' and the server's 'server_share'.
+  * Returns 1 and stores it in 'key' on success, 0 if it was sealed for someone else or with another secret.
+  */
+int seal_unwrap_key(int cipher, EVP_PKEY* own, const uint8_t server_share[SEAL_SHARE_SIZE], key_packet* reply,
+    const char* secret, uint8_t key[SEAL_KEY_SIZE]);
+
+#endif
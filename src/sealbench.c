@@ -0,0 +1,197 @@
+#include "header.h"
+#include "metrics.h"
+#include "seal.h"
+
+/*
+ * Measures what sealing data packets costs compared to plain packets.
+ *
+ * Usage: sealbench [-c aes|chacha] [-w windows] [-p max_slowdown_percent]
+ * Both sides of the per-packet work are timed over the same windows of data: the server building
+ * and checksumming (plain) or sealing (sealed) a window, and the client verifying or opening each
+ * of its packets. Sockets and disk cost the same either way and are left out.
+ * Exits with 1 if either side of a cipher is more than max_slowdown_percent (default 10) slower than plain.
+ */
+
+#define BENCH_DEFAULT_WINDOWS 128
+#define BENCH_DEFAULT_SLOWDOWN 10
+
+typedef struct bench_result
+{
+    uint64_t server_us;
+    uint64_t client_us;
+
+} bench_result;
+
+/**
+  * Megabytes per second for 'windows' full windows in 'us' microseconds.
+  */
+double mb_per_sec(int windows, uint64_t us)
+{
+    return (double) WINDOW_OFFSET(windows) / MAX(us, (uint64_t) 1);
+}
+
+/**
+  * Builds and verifies 'windows' windows of plain packets from 'source', as the server and client do.
+  */
+bench_result run_plain(data_packet* window, const char* source, int windows)
+{
+    bench_result result = { 0, 0 };
+    for (int64_t window_number = 0; window_number < windows; window_number++)
+    {
+        uint64_t start = metrics_now_us();
+        for (int i = 0; i<WINDOW_SIZE; i++)
+        {
+            data_packet* packet = &window[i];
+            memset(packet, 0, sizeof(data_packet));
+            memcpy(packet->body, source + WRITE_LOCATION(i), BUFFER_SIZE);
+            packet->packet_number = i;
+            packet->packet_length = BUFFER_SIZE;
+            packet->window_number = window_number;
+            packet->checksum = get_packet_checksum(packet);
+        }
+
+        uint64_t sent = metrics_now_us();
+        for (int i = 0; i<WINDOW_SIZE; i++)
+        {
+            if (!verify_packet(&window[i]))
+            {
+                fprintf(stderr, "Plain packet %d of window %" PRId64 " failed to verify\n", i, window_number);
+                exit(-1);
+            }
+        }
+
+        result.server_us += sent - start;
+        result.client_us += metrics_now_us() - sent;
+    }
+
+    return result;
+}
+
+/**
+  * Seals and opens 'windows' windows of packets from 'source' with 'cipher', as the server and client do.
+  */
+bench_result run_sealed(int cipher, data_packet* window, const char* source, int windows)
+{
+    seal_state seal;
+    seal_init(&seal, cipher, NULL);
+
+    bench_result result = { 0, 0 };
+    for (int64_t window_number = 0; window_number < windows; window_number++)
+    {
+        /* The copy stands in for the server's read() straight into the packet */
+        uint64_t start = metrics_now_us();
+        for (int i = 0; i<WINDOW_SIZE; i++)
+        {
+            data_packet* packet = &window[i];
+            memcpy(packet->body, source + WRITE_LOCATION(i), BUFFER_SIZE);
+            packet->packet_number = i;
+            packet->packet_length = BUFFER_SIZE;
+            packet->window_number = window_number;
+        }
+        seal_packets(&seal, window, WINDOW_SIZE);
+
+        uint64_t sent = metrics_now_us();
+        for (int i = 0; i<WINDOW_SIZE; i++)
+        {
+            if (!seal_open(&seal, &window[i], window[i].body))
+            {
+                fprintf(stderr, "Sealed packet %d of window %" PRId64 " failed to open\n", i, window_number);
+                exit(-1);
+            }
+        }
+
+        result.server_us += sent - start;
+        result.client_us += metrics_now_us() - sent;
+    }
+
+    if (memcmp(window[WINDOW_SIZE - 1].body, source + WRITE_LOCATION(WINDOW_SIZE - 1), BUFFER_SIZE) != 0)
+    {
+        fprintf(stderr, "Opened packets do not match what was sealed\n");
+        exit(-1);
+    }
+
+    seal_close(&seal);
+    return result;
+}
+
+/**
+  * Prints a row for 'name' and returns 1 if it is within 'max_slowdown' percent of 'plain' on both sides.
+  */
+int report(const char* name, bench_result result, bench_result plain, int windows, int max_slowdown)
+{
+    double server = mb_per_sec(windows, result.server_us), client = mb_per_sec(windows, result.client_us);
+    double server_percent = 100.0 * server / mb_per_sec(windows, plain.server_us);
+    double client_percent = 100.0 * client / mb_per_sec(windows, plain.client_us);
+
+    printf("%-20s %11.0f %7.1f%% %11.0f %7.1f%%\n", name, server, server_percent, client, client_percent);
+
+    return server_percent >= 100 - max_slowdown && client_percent >= 100 - max_slowdown;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, only_cipher = SEAL_NONE;
+    int windows = BENCH_DEFAULT_WINDOWS, max_slowdown = BENCH_DEFAULT_SLOWDOWN;
+    while ((opt = getopt(argc, argv, "c:w:p:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                only_cipher = seal_cipher(optarg);
+                break;
+
+            case 'w':
+                windows = MAX(1, atoi(optarg));
+                break;
+
+            case 'p':
+                max_slowdown = atoi(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-c aes|chacha] [-w windows] [-p max_slowdown_percent]\n", argv[0]);
+                exit(-1);
+        }
+    }
+
+    char* source = malloc(WINDOW_SIZE * BUFFER_SIZE);
+    data_packet* window = calloc(WINDOW_SIZE, sizeof(data_packet));
+    if (source == NULL || window == NULL)
+    {
+        perror("Failed to allocate benchmark buffers");
+        exit(-1);
+    }
+
+    srand(time(NULL));
+    for (int i = 0; i<WINDOW_SIZE * BUFFER_SIZE; i++)
+    {
+        source[i] = rand();
+    }
+
+    printf("%d windows of %d bytes\n", windows, WINDOW_SIZE * BUFFER_SIZE);
+    printf("%-20s %11s %8s %11s %8s\n", "", "server MB/s", "", "client MB/s", "");
+
+    bench_result plain = run_plain(window, source, windows);
+    report("plain (crc32)", plain, plain, windows, max_slowdown);
+
+    int ok = 1;
+    if (only_cipher != SEAL_CHACHA20_POLY1305)
+    {
+        ok &= report("aes-256-gcm", run_sealed(SEAL_AES_GCM, window, source, windows), plain, windows, max_slowdown);
+    }
+    if (only_cipher != SEAL_AES_GCM)
+    {
+        ok &= report("chacha20-poly1305", run_sealed(SEAL_CHACHA20_POLY1305, window, source, windows), plain,
+            windows, max_slowdown);
+    }
+
+    free(source);
+    free(window);
+
+    if (!ok)
+    {
+        printf("Sealing is more than %d%% slower than plain packets\n", max_slowdown);
+        return 1;
+    }
+    return 0;
+}
@@ -1,24 +1,94 @@
+/* For SEEK_DATA and SEEK_HOLE */
+#define _GNU_SOURCE
+
+#include <errno.h>
+
 #include "header.h"
+#include "checksum.h"
+#include "metrics.h"
+#include "trace.h"
+#include "daemon.h"
+#include "fanout.h"
+#include "seal.h"
 
-struct sockaddr_in m_address, tcp_address;
+/* Unused send time carried over by the pacer, lets short stalls catch up without long bursts */
+#define PACE_BURST_US 2000
+
+struct sockaddr_in m_address[MAX_LANES], tcp_address;
 struct stat file_stat;
-int fd, m_sd, tcp_sd, client_sd[MAX_CONNECTIONS];
+int fd, m_sd[MAX_LANES], tcp_sd, client_sd[MAX_CONNECTIONS];
 int highest_sd = 0;
 
-void setup_multicast_socket()
+/* Control messages to the clients, queued so a slow client does not hold up the others */
+fanout control_out;
+
+/* Interface each multicast lane sends from, INADDR_ANY lets the routing table pick */
+struct in_addr lane_interface[MAX_LANES];
+int lanes = 1, lane_mode = LANE_STRIPE;
+
+/* Tells receivers to repair each other before NACKing us */
+int peer_repair = 0;
+
+/* Multicast group of this session, daemon sessions each get their own */
+char multicast_group[IP_LENGTH] = MULTICAST_GROUP;
+
+/* Send rate in bytes per second (0 for no limit), new rates from the daemon arrive on rate_fd */
+uint64_t send_rate = 0, next_send_us = 0;
+int rate_fd = -1;
+
+int checksum_threads = 1;
+
+/* Time the last WINDONE_MSG was sent, used for per-client ACK latency */
+uint64_t windone_us = 0;
+
+/* Window checksums of the source file, and the checksum of all windows ACKed so far */
+checksum_table checksums;
+int file_checksum = 0;
+
+/* Data packets are sealed with -e, every session under its own key, see seal.h */
+int cipher = SEAL_NONE;
+char secret[SEAL_MAX_SECRET + 1] = "";
+seal_state seal;
+EVP_PKEY* exchange_key = NULL;
+
+/* A sealed window is read and sealed in one batch before it is sent, and repairs are resent from it */
+data_packet* sealed_window = NULL;
+int sealed_packets = 0;
+int64_t sealed_window_number = -1;
+off_t sealed_window_end = 0;
+
+/* Packets of the current window that are all zeros, they are left out and only marked in the WINDONE_MSG */
+uint8_t zero_map[WINDOW_SIZE / 8];
+
+/* Data extent of the source from SEEK_DATA and SEEK_HOLE: [hole_start, data_start) is a hole */
+int64_t hole_start = 0, data_start = 0, data_end = 0;
+
+/* Set when started by a relay client, windows are only sent once the client has verified them */
+int follow_fd = -1;
+relay_window followed = { -1, 0 };
+
+void setup_multicast_socket(int lane)
 {
     /* Create multicast UDP socket */
-    if ((m_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((m_sd[lane] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
         perror("UDP socket could not be created\n");
         exit(-1);
     }
 
+    /* Send from the lane's interface */
+    if (lane_interface[lane].s_addr != INADDR_ANY
+        && setsockopt(m_sd[lane], IPPROTO_IP, IP_MULTICAST_IF, &lane_interface[lane], sizeof(struct in_addr)) < 0)
+    {
+        perror("Failed to set multicast interface");
+        exit(-1);
+    }
+
     /* Create address for multicast UDP socket */
-    memset(&m_address, 0, sizeof(m_address));
-    m_address.sin_family = AF_INET;
-    m_address.sin_addr.s_addr = inet_addr(MULTICAST_GROUP);
-    m_address.sin_port = MULTICAST_PORT;
+    memset(&m_address[lane], 0, sizeof(struct sockaddr_in));
+    m_address[lane].sin_family = AF_INET;
+    m_address[lane].sin_addr.s_addr = inet_addr(multicast_group);
+    m_address[lane].sin_port = MULTICAST_PORT + lane;
 }
 
 void setup_server_tcp_socket(int port) 
@@ -47,6 +117,10 @@ void setup_server_tcp_socket(int port)
     tcp_address.sin_addr.s_addr = inet_addr(tcp_ip);
     tcp_address.sin_port = port;
 
+    /* Let a new session reuse the port while the last one's connections are in TIME_WAIT */
+    int yes = 1;
+    setsockopt(tcp_sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
     /* Bind address to socket */
     if (bind(tcp_sd, (struct sockaddr*) &tcp_address, sizeof(tcp_address)) < 0)
     {
@@ -61,9 +135,6 @@ void setup_server_tcp_socket(int port)
         exit(-1);
     }
 
-    int yes = 1;
-    setsockopt(tcp_sd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &yes, sizeof(int));
-
     highest_sd = higher(tcp_sd, highest_sd);
 }
 
@@ -89,7 +160,11 @@ void print_ips()
     freeifaddrs(addrs);
 }
 
-int open_file(char* filepath)
+/**
+  * Opens the file to send and starts checksumming its windows in the background with 'threads' threads.
+  * Returns the checksum of the whole file if it is already known from the cache, otherwise 0.
+  */
+int open_file(char* filepath, int threads)
 {
     if ((fd = open(filepath, O_RDONLY)) < 0)
     {
@@ -103,14 +178,44 @@ int open_file(char* filepath)
         exit(-1);
     }
 
-    /* Do a checksum on the whole file */
-    off_t stop_offset = lseek(fd, 0, SEEK_END);
-    int checksum = get_checksum(fd, 0, stop_offset);
+    /* A relay's file is still being received, the checksums come from the relay client instead */
+    if (follow_fd >= 0)
+    {
+        return 0;
+    }
+
+    /* Clients can connect and receive while the windows are checksummed */
+    checksum_table_open(&checksums, fd, filepath, &file_stat, threads);
+
+    return checksums.file_checksum;
+}
+
+/**
+  * Blocks until the relay client has verified 'window_number'.
+  */
+void follow_window(int64_t window_number)
+{
+    while (followed.window_number < window_number)
+    {
+        if (read(follow_fd, &followed, sizeof(relay_window)) != sizeof(relay_window))
+        {
+            fprintf(stderr, "Relay client stopped before window %" PRId64 "\n", window_number);
+            exit(-1);
+        }
+    }
+}
+
+/**
+  * Returns the checksum of a window, from the checksum threads or from the relay client.
+  */
+int window_checksum(int64_t window_number)
+{
+    if (follow_fd >= 0)
+    {
+        return followed.checksum;
+    }
 
-    /* Reset file offset to beginning of file */
-    lseek(fd, 0, SEEK_SET);
-    
-    return checksum;
+    return checksum_table_get(&checksums, window_number);
 }
 
 /**
@@ -128,43 +233,101 @@ void send_msg(const void* buf, size_t len, int sd, struct sockaddr_in address)
 }
 
 /**
-  * Sends a control packet to all connected TCP clients, specified by client_sd[].
-  * 'conns' specifies the number of clients.
+  * Takes the latest rate from rate_fd if the daemon has sent a new one.
+  */
+void update_send_rate()
+{
+    uint64_t rate;
+    while (rate_fd >= 0 && read(rate_fd, &rate, sizeof(rate)) == sizeof(rate))
+    {
+        send_rate = rate;
+    }
+}
+
+/**
+  * Waits until 'bytes' more can be sent without going over send_rate.
+  */
+void pace(size_t bytes)
+{
+    if (send_rate == 0)
+    {
+        return;
+    }
+
+    uint64_t now = metrics_now_us();
+    next_send_us = MAX(next_send_us, now - MIN(now, PACE_BURST_US));
+    if (next_send_us > now)
+    {
+        usleep(next_send_us - now);
+    }
+    next_send_us += bytes * 1000000 / send_rate;
+}
+
+/**
+  * Sends a data_packet over the multicast lanes.
+  * Striped packets go out on the lane picked by their packet number, mirrored packets on every lane.
+  */
+void send_data_packet(data_packet* packet)
+{
+    for (int lane = 0; lane<lanes; lane++)
+    {
+        if (lane_mode == LANE_MIRROR || packet->packet_number % lanes == lane)
+        {
+            pace(sizeof(data_packet));
+            send_msg(packet, sizeof(data_packet), m_sd[lane], m_address[lane]);
+        }
+    }
+}
+
+/**
+  * Queues a control packet for all connected TCP clients, specified by client_sd[].
   * 'type' specifies the type of control_packet.
   */
-void send_to_all(int conns, int window_number, int type)
+void send_to_all(int64_t window_number, int type)
 {
     control_packet ctrl_packet;
+    memset(&ctrl_packet, 0, sizeof(control_packet));
     if (type == WINDONE_MSG)
     {
         off_t stop_offset = lseek(fd, 0, SEEK_CUR);
-        int checksum = get_checksum(fd, WINDOW_OFFSET(window_number), stop_offset);
+
+        /* Only blocks if the checksum threads have not reached this window yet */
+        uint64_t checksum_start = metrics_now_us();
+        int checksum = window_checksum(window_number);
+        metrics_checksum(checksum_start);
+        windone_us = metrics_now_us();
 
         ctrl_packet.type = WINDONE_MSG;
         ctrl_packet.checksum = checksum;
         ctrl_packet.window_number = window_number;
         ctrl_packet.window_offset = stop_offset;
+        memcpy(ctrl_packet.zero_packets, zero_map, sizeof(zero_map));
     }
     else 
     {
         ctrl_packet.type = type;
+        ctrl_packet.checksum = file_checksum;
     }
 
-    for (int i = 0; i<conns; i++)
-    {
-        send_msg(&ctrl_packet, sizeof(control_packet), client_sd[i], tcp_address);
-    }
+    TRACE(TRACE_CONTROL_SEND, window_number, type);
+    fanout_append(&control_out, &ctrl_packet, sizeof(control_packet));
 }
 
 /**
   * Creates a header_packet and stores it in address pointed to by 'header'.
   */
-void create_header_packet(header_packet* header, int filesize, int packet_size, int checksum, char filename[])
+void create_header_packet(header_packet* header, int64_t filesize, int packet_size, int checksum, char filename[])
 {
     header->filesize = filesize;
     header->packet_size = packet_size;
     header->packet_count = (filesize / packet_size ) + 1;
     header->checksum = checksum;
+    header->lanes = lanes;
+    header->lane_mode = lane_mode;
+    strcpy(header->group, multicast_group);
+    header->peer_repair = peer_repair;
+    header->cipher = cipher;
+    memset(header->key_share, 0, SEAL_SHARE_SIZE);
     strcpy(header->filename, filename);
 }
 
@@ -172,41 +335,185 @@ void create_header_packet(header_packet* header, int filesize, int packet_size,
   * Creates a data_packet and stores it in address pointed to by 'packet'.
   * 'packet_length' bytes from 'buf' are written to the body of the data_packet.
   */
-void create_data_packet(data_packet* packet, void* buf, int packet_number, int packet_length, int window_number)
+void create_data_packet(data_packet* packet, void* buf, int packet_number, int packet_length, int64_t window_number)
 {
     memset(packet, 0, sizeof(data_packet));
     memcpy(packet->body, buf, packet_length);
     packet->packet_number = packet_number;
     packet->packet_length = packet_length;
     packet->window_number = window_number;
+    packet->checksum = get_packet_checksum(packet);
+}
+
+/**
+  * Returns 1 if the 'len' bytes at 'offset' in the source are in a hole, so they don't need reading.
+  * The file offset of 'fd' is not changed.
+  */
+int in_hole(int64_t offset, int64_t len)
+{
+    /* The last lookup only says [hole_start, data_end) is a hole followed by data */
+    if (offset < hole_start || offset >= data_end)
+    {
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        hole_start = offset;
+        data_start = lseek(fd, offset, SEEK_DATA);
+        if (data_start < 0)
+        {
+            /* ENXIO means there is no data after 'offset', anything else that holes can't be found */
+            data_start = (errno == ENXIO) ? INT64_MAX : offset;
+            data_end = INT64_MAX;
+        }
+        else
+        {
+            data_end = lseek(fd, data_start, SEEK_HOLE);
+        }
+        lseek(fd, position, SEEK_SET);
+    }
+
+    return offset + len <= data_start;
+}
+
+/**
+  * Reads packet 'packet_number' of 'window_number' into 'packet' from the current file offset.
+  * A packet in a hole is skipped over without reading, and it or a packet read as zeros is marked in zero_map.
+  * Returns the number of bytes in the packet, 0 at the end of the file.
+  */
+int read_packet(data_packet* packet, int packet_number, int64_t window_number)
+{
+    int64_t offset = WINDOW_OFFSET(window_number) + WRITE_LOCATION(packet_number);
+    int nbytes = MIN(BUFFER_SIZE, MAX(file_stat.st_size - offset, 0));
+
+    /* A relay's file is still being filled past the verified windows, so a hole found there now may be data
+       later. Holes the relay client punched for zero packets read as zeros and are still skipped below */
+    if (nbytes > 0 && follow_fd < 0 && in_hole(offset, nbytes))
+    {
+        lseek(fd, nbytes, SEEK_CUR);
+    }
+    else if ((nbytes = read(fd, packet->body, BUFFER_SIZE)) <= 0)
+    {
+        return 0;
+    }
+    else if (!is_zero(packet->body, nbytes))
+    {
+        return nbytes;
+    }
+
+    ZERO_MAP_SET(zero_map, packet_number);
+    g_metrics.packets_sparse++;
+    return nbytes;
+}
+
+/**
+  * Reads the next window from the file and seals all of its packets in one batch.
+  * Returns the number of packets in the window.
+  */
+int seal_window(int64_t window_number)
+{
+    int count = 0, nbytes;
+    while (count < WINDOW_SIZE && (nbytes = read_packet(&sealed_window[count], count, window_number)) > 0)
+    {
+        sealed_window[count].packet_number = count;
+        sealed_window[count].packet_length = nbytes;
+        sealed_window[count].window_number = window_number;
+        count++;
+    }
+
+    /* Zero packets are never sent, so only the runs between them are sealed */
+    int start = 0;
+    while (start < count)
+    {
+        int end = start;
+        while (end < count && !ZERO_MAP_TEST(zero_map, end))
+        {
+            end++;
+        }
+        seal_packets(&seal, &sealed_window[start], end - start);
+
+        start = end;
+        while (start < count && ZERO_MAP_TEST(zero_map, start))
+        {
+            start++;
+        }
+    }
+    return count;
+}
+
+/**
+  * Returns packet 'sequence_number' of the window being sent, or NULL once the whole file has been sent.
+  * Plain packets are read into 'packet', sealed ones were already read by seal_window().
+  */
+data_packet* next_packet(data_packet* packet, int sequence_number, int64_t window_number)
+{
+    if (cipher != SEAL_NONE)
+    {
+        return (sequence_number < sealed_packets) ? &sealed_window[sequence_number] : NULL;
+    }
+
+    memset(packet, 0, sizeof(data_packet));
+    int nbytes = read_packet(packet, sequence_number, window_number);
+    if (nbytes <= 0)
+    {
+        return NULL;
+    }
+
+    packet->packet_number = sequence_number;
+    packet->packet_length = nbytes;
+    packet->window_number = window_number;
+    packet->checksum = get_packet_checksum(packet);
+    return packet;
 }
 
 /**
   * Finds the missing packet specified by the packet_number and window_number
-  * and sends the packet through the multicast socket m_sd.
+  * and sends the packet through the multicast lanes.
   */
-void resend_missing_packet(int packet_number, int window_number)
+void resend_missing_packet(int packet_number, int64_t window_number)
 {
     data_packet packet;
     int nbytes;
 
+    /* Sealed packets are still in the window they were sent from, apart from zero packets which never were */
+    if (cipher != SEAL_NONE && packet_number >= 0 && packet_number < sealed_packets
+        && !ZERO_MAP_TEST(zero_map, packet_number))
+    {
+        TRACE(TRACE_REPAIR_SEND, window_number, packet_number);
+        send_data_packet(&sealed_window[packet_number]);
+        return;
+    }
+
     char buffer[BUFFER_SIZE];
-    memset(&buffer, 0, BUFFER_SIZE+1);
+    memset(&buffer, 0, BUFFER_SIZE);
+    int64_t offset = WINDOW_OFFSET(window_number) + WRITE_LOCATION(packet_number);
+
+    /* Only zero packets and the empty packet after the end of the window are not in the sealed window.
+       They are rebuilt from what the window held when it was sealed rather than read again, so a file
+       that changed since can't get other data sealed under their nonces */
+    if (cipher != SEAL_NONE)
+    {
+        nbytes = (packet_number < sealed_packets) ? MIN(BUFFER_SIZE, MAX(file_stat.st_size - offset, 0)) : 0;
+        create_data_packet(&packet, buffer, packet_number, nbytes, window_number);
+        seal_packets(&seal, &packet, 1);
+
+        TRACE(TRACE_REPAIR_SEND, window_number, packet_number);
+        send_data_packet(&packet);
+        return;
+    }
 
     /* lseek() to find the starting offset of the missing packet */
-    lseek(fd, WINDOW_OFFSET(window_number) + WRITE_LOCATION(packet_number), SEEK_SET);
+    lseek(fd, offset, SEEK_SET);
     nbytes = read(fd, buffer, BUFFER_SIZE);
 
     create_data_packet(&packet, buffer, packet_number, nbytes, window_number);
 
-    send_msg(&packet, sizeof(data_packet), m_sd, m_address);
+    TRACE(TRACE_REPAIR_SEND, window_number, packet_number);
+    send_data_packet(&packet);
 }
 
 /**
   * Handler for nack_packets. 
   * Reads a nack_packet from 'sd' and resends all packets listed in nack_packet.missing_packets[].
   */
-void handleNackMessage(int sd, int window_number)
+void handleNackMessage(int sd, int64_t window_number)
 {
     nack_packet nack;
     int nbytes;
@@ -216,9 +523,14 @@ void handleNackMessage(int sd, int window_number)
         exit(-1);
     }
 
+    TRACE(TRACE_NACK_RECV, window_number, nack.missing_packet_count);
+    g_metrics.window.repair_rounds++;
+    g_metrics.window.packets_nacked += nack.missing_packet_count;
+
     for (int i = 0; i<nack.missing_packet_count; i++)
     {
         resend_missing_packet(nack.missing_packets[i], window_number);
+        g_metrics.window.packets_resent++;
     }
 
 }
@@ -227,7 +539,7 @@ void handleNackMessage(int sd, int window_number)
   * Handler for all client TCP messages.
   * Message types are specified in "header.h"
   */
-int handleClientMessage(int sd, int window_number, int acks, int* resend)
+int handleClientMessage(int sd, int64_t window_number, int acks, int* resend)
 {
     control_packet msg;
     int nbytes;
@@ -237,13 +549,16 @@ int handleClientMessage(int sd, int window_number, int acks, int* resend)
         exit(-1);
     }
 
+    TRACE(TRACE_CONTROL_RECV, window_number, msg.type);
     switch(msg.type)
     {
         case ACK_MSG:
+            metrics_ack_latency(metrics_now_us() - windone_us);
             return acks + 1;
 
         case RESEND_MSG:
-            printf("Resending window %d\n", window_number);
+            metrics_ack_latency(metrics_now_us() - windone_us);
+            printf("Resending window %" PRId64 "\n", window_number);
             *resend = 1;
             return acks + 1;
 
@@ -256,6 +571,22 @@ int handleClientMessage(int sd, int window_number, int acks, int* resend)
 
 }
 
+/**
+  * Reads the client's half of the key exchange from 'sd' and replies with the sealed session key.
+  */
+void send_session_key(int sd)
+{
+    key_packet request, reply;
+    if (recv(sd, &request, sizeof(key_packet), MSG_WAITALL) != sizeof(key_packet))
+    {
+        fprintf(stderr, "Client disconnected during the key exchange\n");
+        exit(-1);
+    }
+
+    seal_wrap_key(&seal, exchange_key, &request, secret, &reply);
+    send_msg(&reply, sizeof(key_packet), sd, tcp_address);
+}
+
 /**
   * Accept an incoming client connection and send them the header for the file.
   * Returns the socket descriptor for this client connection.
@@ -270,39 +601,72 @@ int accept_client_connection(header_packet header, int conns)
     }
     highest_sd = higher(client_sd[conns], highest_sd);
 
+    /* Control messages are small and latency sensitive, so don't let Nagle hold them back */
+    int yes = 1;
+    setsockopt(client_sd[conns], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
     send_msg(&header, sizeof(header), client_sd[conns], tcp_address);
 
+    /* A sealed session's key is handed over before the client joins the group */
+    if (cipher != SEAL_NONE)
+    {
+        send_session_key(client_sd[conns]);
+    }
+
     return client_sd[conns];
 }
 
-
-
-int main(int argc, char const *argv[])
+/**
+  * Waits for every client to say it has joined the multicast group, so no data is sent before anyone listens.
+  */
+void wait_for_ready(int conns)
 {
-    (void)argc;
+    for (int i = 0; i<conns; i++)
+    {
+        control_packet msg;
+        if (recv(client_sd[i], &msg, sizeof(control_packet), MSG_WAITALL) != sizeof(control_packet) || msg.type != READY_MSG)
+        {
+            fprintf(stderr, "Client %d disconnected before it was ready\n", i);
+            exit(-1);
+        }
+    }
+}
 
-    int num_clients = atoi(argv[1]);
-    char file_to_send[PATH_MAX + MAX_FILENAME];
-    strcpy(file_to_send, argv[2]);
-    int port = atoi(argv[3]);
-    print_ips(); 
+int run_session(int num_clients, char* filepath, int port, const char* group, uint64_t rate, int new_rate_fd)
+{
+    strcpy(multicast_group, group);
+    send_rate = rate;
+    rate_fd = new_rate_fd;
 
-    setup_multicast_socket();
+    for (int lane = 0; lane<lanes; lane++)
+    {
+        setup_multicast_socket(lane);
+    }
     setup_server_tcp_socket(port);
 
-    int checksum = open_file(file_to_send);
+    int checksum = open_file(filepath, checksum_threads);
 
     header_packet header;
-    create_header_packet(&header, file_stat.st_size, BUFFER_SIZE, checksum, basename(file_to_send));
+    create_header_packet(&header, file_stat.st_size, BUFFER_SIZE, checksum, basename(filepath));
 
-    char buffer[BUFFER_SIZE];
-    memset(&buffer, 0, BUFFER_SIZE+1);
+    if (cipher != SEAL_NONE)
+    {
+        seal_init(&seal, cipher, NULL);
+        exchange_key = seal_keypair(header.key_share);
+
+        /* Zeroed so the unused end of a short packet never carries old memory */
+        if ((sealed_window = calloc(WINDOW_SIZE, sizeof(data_packet))) == NULL)
+        {
+            perror("Failed to allocate sealed window");
+            exit(-1);
+        }
+    }
 
     /* Structs for timing */
     struct timespec start_time, stop_time;
 
     /* Create socket descriptor lists for select() */
-    fd_set readfds, master;
+    fd_set readfds, writefds, master;
     FD_ZERO(&master);
 
     /* Accept connections and add the client socket to master */
@@ -316,45 +680,95 @@ int main(int argc, char const *argv[])
         {
             /* Start timing how long it takes to transfer the file to clients */
             clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+            g_metrics.start_us = metrics_now_us();
         }
     }
+    wait_for_ready(connections);
+    fanout_init(&control_out, client_sd, connections);
 
     print_header(header);
 
-    int nbytes = 1, window_number = 0;
+    int nbytes = 1;
+    int64_t window_number = 0;
     while (nbytes > 0)
     {
         int sequence_number = 0;
-        lseek(fd, window_number*WINDOW_SIZE*BUFFER_SIZE, SEEK_SET);
+        if (follow_fd >= 0)
+        {
+            follow_window(window_number);
+        }
+        lseek(fd, WINDOW_OFFSET(window_number), SEEK_SET);
+        update_send_rate();
+        metrics_window_start();
+        TRACE(TRACE_WINDOW_START, window_number, 0);
+
+        /* A resent window goes out exactly as it was sealed, sealing it again would reuse its nonces
+           for whatever the file holds now if it changed */
+        if (cipher == SEAL_NONE)
+        {
+            memset(zero_map, 0, sizeof(zero_map));
+        }
+        else if (window_number != sealed_window_number)
+        {
+            memset(zero_map, 0, sizeof(zero_map));
+            sealed_packets = seal_window(window_number);
+            sealed_window_number = window_number;
+            sealed_window_end = lseek(fd, 0, SEEK_CUR);
+        }
+        else
+        {
+            /* WINDONE takes the end of the window from the file offset, as if it had been read again */
+            lseek(fd, sealed_window_end, SEEK_SET);
+        }
 
         /* Send a window */
-        while (sequence_number < WINDOW_SIZE && (nbytes = read(fd, buffer, BUFFER_SIZE)) > 0)
+        data_packet packet, *next;
+        while (sequence_number < WINDOW_SIZE && (next = next_packet(&packet, sequence_number, window_number)) != NULL)
         {
-            data_packet packet;
-            create_data_packet(&packet, buffer, sequence_number, nbytes, window_number);
-
-            send_msg(&packet, sizeof(data_packet), m_sd, m_address);
+            if (!ZERO_MAP_TEST(zero_map, sequence_number))
+            {
+                TRACE(TRACE_PACKET_SEND, window_number, sequence_number);
+                send_data_packet(next);
+                g_metrics.window.bytes += next->packet_length;
+            }
 
-            /* Reset data buffer for next read */
-            memset(&buffer, 0, BUFFER_SIZE + 1);
+            /* Finish sending the last ACK to clients whose socket was full */
+            if (control_out.pending > 0)
+            {
+                fanout_flush(&control_out);
+            }
 
             sequence_number++;
         }
 
+        /* A window that isn't full is the end of the file */
+        nbytes = (sequence_number < WINDOW_SIZE) ? 0 : 1;
+
+        g_metrics.window.send_us = metrics_now_us() - g_metrics.window.start_us;
+        g_metrics.packets += sequence_number;
+        g_metrics.bytes += g_metrics.window.bytes;
+
         /* Tell all clients the window has finished */
-        send_to_all(connections, window_number, WINDONE_MSG);
+        send_to_all(window_number, WINDONE_MSG);
 
         /* Get control_packets and nacks from clients */
         int acks = 0, resend = 0;
         while (acks < connections)
         {
             readfds = master;
-            if (select(highest_sd+1, &readfds, NULL, NULL, NULL) < 0)
+            FD_ZERO(&writefds);
+            fanout_writefds(&control_out, &writefds);
+            if (select(highest_sd+1, &readfds, &writefds, NULL, NULL) < 0)
             {
                 perror("Failed on selecting socket");
                 exit(-1);
             }
 
+            if (control_out.pending > 0)
+            {
+                fanout_flush(&control_out);
+            }
+
             for (int i = 0; i<connections; i++)
             {
                 if (FD_ISSET(client_sd[i], &readfds))
@@ -363,26 +777,40 @@ int main(int argc, char const *argv[])
                 }
             }
         }
-        printf("Window %d finished transmitting, sent %d packets \n", window_number, sequence_number);
+        printf("Window %" PRId64 " finished transmitting, sent %d packets \n", window_number, sequence_number);
+
+        metrics_socket_drops(m_sd, lanes);
+        metrics_window_end(window_number, resend);
+        TRACE(TRACE_WINDOW_END, window_number, 0);
 
         /* Tell clients if we are moving to the next window or resending a window */
         if (resend)
         {
-            send_to_all(connections, 0, RESEND_MSG);
+            send_to_all(0, RESEND_MSG);
             nbytes = 1;
         }
         else
         {
-            send_to_all(connections, 0, ACK_MSG);
+            file_checksum = fold_checksum(file_checksum, window_checksum(window_number));
+            send_to_all(0, ACK_MSG);
             window_number++;
+            if (follow_fd < 0)
+            {
+                checksum_table_release(&checksums, window_number);
+            }
         }
     }
 
+    /* The transfer is only complete once every client has been sent the last ACK */
+    fanout_drain(&control_out);
+
     /* Stop the timer as file transfer is complete */
     clock_gettime(CLOCK_MONOTONIC_RAW, &stop_time);
 
     uint64_t time_taken = (stop_time.tv_sec - start_time.tv_sec) * 1000 + (stop_time.tv_nsec - start_time.tv_nsec) / 1000000;
     printf("Time taken: %" PRIu64 "ms\n", time_taken);
+    metrics_finish();
+    trace_finish();
 
     /* Clean up */
     for (int i = 0; i<connections; i++)
@@ -390,7 +818,131 @@ int main(int argc, char const *argv[])
         close(client_sd[i]);
     }
     close(tcp_sd);
-    close(m_sd);
+    for (int lane = 0; lane<lanes; lane++)
+    {
+        close(m_sd[lane]);
+    }
+    fanout_close(&control_out);
+    if (cipher != SEAL_NONE)
+    {
+        seal_close(&seal);
+        EVP_PKEY_free(exchange_key);
+        free(sealed_window);
+    }
+    if (follow_fd < 0)
+    {
+        checksum_table_close(&checksums);
+    }
     close(fd);
     return 0;
 }
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [num_clients] [filepath] [port] [-m json:path|prom:path] [-t trace_path] [-j checksum_threads]\n"
+        "       [-i interface,...] [-M] [-r bytes_per_sec] [-g group] [-F relay_fd] [-P] [-e aes|chacha] [-k secret_file]\n"
+        "       %s -d control_socket [-b bytes_per_sec] [-n max_sessions] [-j checksum_threads] [-i interface,...] [-M] [-P]\n"
+        "       [-e aes|chacha] [-k secret_file]\n",
+        name, name);
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, max_sessions = 4;
+    char* control_path = NULL;
+    char group[IP_LENGTH] = MULTICAST_GROUP;
+    uint64_t rate = 0;
+    checksum_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "m:t:j:i:Mr:d:b:n:g:F:Pe:k:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                metrics_init("server", optarg);
+                break;
+
+            case 't':
+                trace_init("server", optarg);
+                break;
+
+            case 'j':
+                checksum_threads = atoi(optarg);
+                break;
+
+            case 'i':
+                lanes = parse_interfaces(optarg, lane_interface);
+                break;
+
+            case 'M':
+                lane_mode = LANE_MIRROR;
+                break;
+
+            case 'r':
+            case 'b':
+                rate = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                control_path = optarg;
+                break;
+
+            case 'n':
+                max_sessions = MAX(1, MIN(atoi(optarg), MAX_SESSIONS));
+                break;
+
+            case 'g':
+                strncpy(group, optarg, IP_LENGTH - 1);
+                break;
+
+            case 'F':
+                follow_fd = atoi(optarg);
+                break;
+
+            case 'P':
+                peer_repair = 1;
+                break;
+
+            case 'e':
+                cipher = seal_cipher(optarg);
+                break;
+
+            case 'k':
+                seal_read_secret(optarg, secret);
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (secret[0] != '\0' && cipher == SEAL_NONE)
+    {
+        fprintf(stderr, "-k can only be used with -e\n");
+        usage(argv[0]);
+    }
+
+    if (control_path != NULL)
+    {
+        /* Sessions run concurrently, so they can't share one metrics or trace file */
+        if (g_metrics.format != METRICS_NONE || trace_enabled)
+        {
+            fprintf(stderr, "-m and -t can not be used with -d\n");
+            usage(argv[0]);
+        }
+        return run_daemon(control_path, rate, max_sessions);
+    }
+
+    if (argc - optind < 3)
+    {
+        usage(argv[0]);
+    }
+
+    int num_clients = atoi(argv[optind]);
+    char file_to_send[PATH_MAX + MAX_FILENAME];
+    strcpy(file_to_send, argv[optind + 1]);
+    int port = atoi(argv[optind + 2]);
+    print_ips(); 
+
+    return run_session(num_clients, file_to_send, port, group, rate, -1);
+}
@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
+#include "header.h"
+#include "stream.h"
+
+/* Largest piece passed on at once, so a larger prefix is noticed while a long copy is still going */
+#define STREAM_CHUNK ((int64_t) WINDOW_SIZE * BUFFER_SIZE)
+
+/**
+  * Opens 'target' for writing and returns its descriptor, see stream_open().
+  */
+static int open_target(const char* target)
+{
+    int out;
+    if (strcmp(target, "-") == 0)
+    {
+        /* The data takes over stdout, so our own messages go to stderr from now on */
+        fflush(stdout);
+        if ((out = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+            perror("Failed to take over stdout");
+            exit(-1);
+        }
+        return out;
+    }
+
+    if (strncmp(target, "fd:", 3) == 0)
+    {
+        return atoi(target + 3);
+    }
+
+    if (strncmp(target, "unix:", 5) == 0)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(struct sockaddr_un));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, target + 5, sizeof(address.sun_path) - 1);
+
+        if ((out = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || connect(out, (struct sockaddr*) &address, sizeof(struct sockaddr_un)) < 0)
+        {
+            perror("Failed to connect to stream socket");
+            exit(-1);
+        }
+        return out;
+    }
+
+    /* Opening a named pipe blocks until the consumer opens the other end */
+    if ((out = open(target, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+    {
+        perror("Failed to open stream target");
+        exit(-1);
+    }
+    return out;
+}
+
+/**
+  * Copies 'len' bytes at 'offset' in the file to the consumer.
+  * Returns 1 on success, 0 if the consumer has gone away.
+  */
+static int copy_out(stream_state* stream, int64_t offset, int64_t len)
+{
+    while (len > 0)
+    {
+        off_t from = offset;
+        ssize_t nbytes = sendfile(stream->out, stream->fd, &from, MIN(len, STREAM_CHUNK));
+
+        /* sendfile() can't write to every kind of descriptor, so fall back to copying */
+        if (nbytes < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            char buffer[BUFFER_SIZE];
+            if ((nbytes = pread(stream->fd, buffer, MIN(len, BUFFER_SIZE), offset)) > 0)
+            {
+                nbytes = write(stream->out, buffer, nbytes);
+            }
+        }
+
+        /* An inherited descriptor may be non-blocking */
+        if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            struct pollfd writable = { stream->out, POLLOUT, 0 };
+            poll(&writable, 1, -1);
+            continue;
+        }
+
+        if (nbytes < 0 && errno != EINTR)
+        {
+            perror("Stopped streaming");
+            return 0;
+        }
+        if (nbytes == 0)
+        {
+            fprintf(stderr, "Stopped streaming, destination file is shorter than the verified prefix\n");
+            return 0;
+        }
+
+        if (nbytes > 0)
+        {
+            offset += nbytes;
+            len -= nbytes;
+        }
+    }
+
+    return 1;
+}
+
+/**
+  * Returns 1 if the consumer or the notification fd is behind the verified prefix.
+  * Only the thread changes 'streamed' and 'notified', so this is safe under the lock.
+  */
+static int stream_pending(stream_state* stream)
+{
+    return (stream->out >= 0 && stream->streamed < stream->verified)
+        || (stream->notify >= 0 && stream->notified < stream->verified);
+}
+
+static void* stream_worker(void* arg)
+{
+    stream_state* stream = arg;
+
+    pthread_mutex_lock(&stream->lock);
+    while (1)
+    {
+        while (!stream->finished && !stream_pending(stream))
+        {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        if (!stream_pending(stream))
+        {
+            break;
+        }
+
+        int64_t verified = stream->verified;
+        pthread_mutex_unlock(&stream->lock);
+
+        if (stream->notify >= 0 && stream->notified < verified)
+        {
+            if (dprintf(stream->notify, "%" PRId64 " %" PRId64 "\n", verified, stream->file_size) < 0)
+            {
+                perror("Stopped notifying");
+                close(stream->notify);
+                stream->notify = -1;
+            }
+            stream->notified = verified;
+        }
+
+        if (stream->out >= 0 && stream->streamed < verified)
+        {
+            if (!copy_out(stream, stream->streamed, verified - stream->streamed))
+            {
+                close(stream->out);
+                stream->out = -1;
+            }
+            stream->streamed = verified;
+        }
+
+        pthread_mutex_lock(&stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+void stream_open(stream_state* stream, const char* target, int notify)
+{
+    memset(stream, 0, sizeof(stream_state));
+    stream->fd = -1;
+    stream->out = (target != NULL) ? open_target(target) : -1;
+    stream->notify = notify;
+
+    /* A consumer that exits early stops the stream, not the transfer */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+void stream_start(stream_state* stream, int fd, int64_t file_size)
+{
+    stream->fd = fd;
+    stream->file_size = file_size;
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    if (pthread_create(&stream->thread, NULL, stream_worker, stream) != 0)
+    {
+        perror("Failed to start stream thread");
+        exit(-1);
+    }
+}
+
+void stream_verified(stream_state* stream, int64_t prefix)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->verified = MAX(stream->verified, prefix);
+    pthread_cond_signal(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void stream_close(stream_state* stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->finished = 1;
+    pthread_cond_signal(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(stream->thread, NULL);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->changed);
+
+    if (stream->out >= 0)
+    {
+        close(stream->out);
+    }
+    if (stream->notify >= 0)
+    {
+        close(stream->notify);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef __MCAST_STREAM_H
+#define __MCAST_STREAM_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Passes the verified in-order prefix of the destination file on while the transfer is still running.
+ * Windows are ACKed in order, so once a window is ACKed everything before its end is final.
+ * A thread copies each new part of the prefix to the consumer with sendfile(), so a slow consumer
+ * only holds up itself and never the receive loop, and reports progress on the notification fd.
+ */
+
+typedef struct stream_state
+{
+    /* Destination file, and where the data goes (-1 for none) */
+    int fd;
+    int out;
+
+    /* Gets a "verified_bytes file_size" line whenever the prefix grows, -1 for none */
+    int notify;
+
+    int64_t file_size;
+    int64_t verified;
+    int64_t streamed;
+    int64_t notified;
+    int finished;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+} stream_state;
+
+
+/**
+  * Opens the consumer 'target': "-" for stdout, "unix:path" for a listening unix socket, "fd:n" for an
+  * inherited descriptor such as a pipe, or the path of a named pipe or file. NULL if only 'notify' is used.
+  * 'notify' is the notification fd or -1. Streaming to stdout moves our own output to stderr,
+  * so this is called before anything is printed.
+  */
+void stream_open(stream_state* stream, const char* target, int notify);
+
+/**
+  * Starts the thread passing on the destination file open on 'fd', once its size is known.
+  */
+void stream_start(stream_state* stream, int fd, int64_t file_size);
+
+/**
+  * Tells the thread the first 'prefix' bytes of the file are verified and can be passed on.
+  */
+void stream_verified(stream_state* stream, int64_t prefix);
+
+/**
+  * Waits until the consumer has been given the whole verified prefix, then closes it and the notification fd
+  * so both see the end of the transfer.
+  */
+void stream_close(stream_state* stream);
+
+#endif
@@ -0,0 +1,229 @@
+#include "header.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+/*
+ * Each thread owns one ring and is its only writer, so recording an event needs no locks.
+ * Rings are pushed onto a lock-free list when first used so trace_finish() can find them.
+ */
+typedef struct trace_ring
+{
+    trace_event* events;
+    uint64_t head;
+    uint32_t thread_id;
+    struct trace_ring* next;
+
+} trace_ring;
+
+int trace_enabled = 0;
+
+static char trace_path[PATH_MAX];
+static char trace_role[16];
+static trace_ring* rings = NULL;
+static __thread trace_ring* thread_ring = NULL;
+
+/* Set by whichever of exit, a signal or an explicit trace_finish() writes the file first */
+static int trace_written = 0;
+
+static void trace_signal(int signum);
+
+static const char* event_names[TRACE_EVENT_TYPES] = {
+    "unknown",
+    "window_start",
+    "window_end",
+    "packet_send",
+    "packet_recv",
+    "nack_send",
+    "nack_recv",
+    "repair_send",
+    "repair_recv",
+    "checksum_start",
+    "checksum_end",
+    "control_send",
+    "control_recv",
+    "write_start",
+    "write_end",
+    "packet_corrupt",
+    "peer_request_send",
+    "peer_request_recv",
+    "peer_repair_send",
+    "peer_repair_suppress",
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_init(const char* role, const char* path)
+{
+#ifndef ENABLE_TRACE
+    fprintf(stderr, "Tracing was not compiled in, rebuild with 'make TRACE=1'\n");
+#endif
+    strncpy(trace_path, path, PATH_MAX - 1);
+    strncpy(trace_role, role, sizeof(trace_role) - 1);
+    trace_enabled = 1;
+
+    /* A transfer that fails or is killed is the one worth a trace, so write it however the process ends */
+    atexit(trace_finish);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_signal;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+/**
+  * Allocates the ring for the calling thread and adds it to 'rings'.
+  */
+static trace_ring* create_ring(void)
+{
+    trace_ring* ring = calloc(1, sizeof(trace_ring));
+    if (ring == NULL || (ring->events = calloc(TRACE_RING_SIZE, sizeof(trace_event))) == NULL)
+    {
+        perror("Failed to allocate trace buffer");
+        exit(-1);
+    }
+    ring->thread_id = syscall(SYS_gettid);
+
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return ring;
+}
+
+void trace_record(int type, int64_t arg1, int arg2)
+{
+    if (thread_ring == NULL)
+    {
+        thread_ring = create_ring();
+    }
+
+    trace_ring* ring = thread_ring;
+    trace_event* event = &ring->events[ring->head & (TRACE_RING_SIZE - 1)];
+
+    event->timestamp_ns = clock_ns(CLOCK_MONOTONIC);
+    event->thread_id = ring->thread_id;
+    event->type = type;
+    event->arg1 = arg1;
+    event->arg2 = arg2;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+  * Writes 'len' bytes of 'buf' to 'fd'. Returns 1 on success, 0 on failure.
+  */
+static int write_all(int fd, const void* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t nbytes = write(fd, buf, len);
+        if (nbytes < 0 && errno != EINTR)
+        {
+            return 0;
+        }
+        if (nbytes > 0)
+        {
+            buf = (const char*) buf + nbytes;
+            len -= nbytes;
+        }
+    }
+    return 1;
+}
+
+/**
+  * Writes the events of every thread to the trace file the first time it is called, and fills in 'header'.
+  * Only uses async-signal-safe calls so it can also run from trace_signal().
+  * Returns 1 if the file was written.
+  */
+static int write_trace(trace_file_header* header)
+{
+    if (!trace_enabled || __atomic_exchange_n(&trace_written, 1, __ATOMIC_ACQ_REL))
+    {
+        return 0;
+    }
+
+    int out = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (out < 0)
+    {
+        return 0;
+    }
+
+    memset(header, 0, sizeof(trace_file_header));
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    header->event_size = sizeof(trace_event);
+    header->monotonic_base_ns = clock_ns(CLOCK_MONOTONIC);
+    header->realtime_base_ns = clock_ns(CLOCK_REALTIME);
+    strncpy(header->role, trace_role, sizeof(header->role) - 1);
+
+    trace_ring* list = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (trace_ring* ring = list; ring != NULL; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        header->event_count += MIN(head, TRACE_RING_SIZE);
+        header->dropped += (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    }
+    int ok = write_all(out, header, sizeof(trace_file_header));
+
+    /* Write each ring oldest event first */
+    for (trace_ring* ring = list; ok && ring != NULL; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t start = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+        uint64_t first = start & (TRACE_RING_SIZE - 1);
+        uint64_t count = head - start;
+        uint64_t tail = MIN(count, TRACE_RING_SIZE - first);
+
+        ok = write_all(out, &ring->events[first], tail * sizeof(trace_event))
+            && write_all(out, ring->events, (count - tail) * sizeof(trace_event));
+    }
+
+    close(out);
+    return ok;
+}
+
+/**
+  * SIGINT and SIGTERM handler, writes the trace and then lets the signal end the process as it would have.
+  */
+static void trace_signal(int signum)
+{
+    trace_file_header header;
+    write_trace(&header);
+    raise(signum);
+}
+
+void trace_finish(void)
+{
+    trace_file_header header;
+    if (!trace_enabled || __atomic_load_n(&trace_written, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    if (!write_trace(&header))
+    {
+        perror("Failed to write trace file");
+        return;
+    }
+    printf("Wrote %" PRIu64 " trace events to %s (%" PRIu64 " dropped)\n", header.event_count, trace_path, header.dropped);
+}
+
+const char* trace_event_name(int type)
+{
+    if (type <= 0 || type >= TRACE_EVENT_TYPES)
+    {
+        return event_names[0];
+    }
+
+    return event_names[type];
+}
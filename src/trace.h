@@ -0,0 +1,99 @@
+#ifndef __MCAST_TRACE_H
+#define __MCAST_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Timeline tracing.
+ * Events are written to a per-thread ring buffer and dumped to a binary file by trace_finish().
+ * Build with -DENABLE_TRACE (the default, disable with 'make TRACE=0') and enable at runtime with -t.
+ */
+
+#define TRACE_MAGIC "MCTRACE1"
+#define TRACE_VERSION 2
+
+/* Events per thread ring, must be a power of two. The oldest events are overwritten when full. */
+#define TRACE_RING_SIZE (1 << 20)
+
+/* Types of trace events, arg1 is always the window number */
+#define TRACE_WINDOW_START 1
+#define TRACE_WINDOW_END 2
+#define TRACE_PACKET_SEND 3     /* arg2: packet number */
+#define TRACE_PACKET_RECV 4     /* arg2: packet number */
+#define TRACE_NACK_SEND 5       /* arg2: missing packet count */
+#define TRACE_NACK_RECV 6       /* arg2: missing packet count */
+#define TRACE_REPAIR_SEND 7     /* arg2: packet number */
+#define TRACE_REPAIR_RECV 8     /* arg2: packet number */
+#define TRACE_CHECKSUM_START 9
+#define TRACE_CHECKSUM_END 10
+#define TRACE_CONTROL_SEND 11   /* arg2: control message type */
+#define TRACE_CONTROL_RECV 12   /* arg2: control message type */
+#define TRACE_WRITE_START 13    /* arg2: packet number */
+#define TRACE_WRITE_END 14      /* arg2: packet number */
+#define TRACE_PACKET_CORRUPT 15 /* arg2: packet number */
+#define TRACE_PEER_REQUEST_SEND 16      /* arg2: missing packet count */
+#define TRACE_PEER_REQUEST_RECV 17      /* arg2: missing packet count */
+#define TRACE_PEER_REPAIR_SEND 18       /* arg2: packet number */
+#define TRACE_PEER_REPAIR_SUPPRESS 19   /* arg2: packet number */
+#define TRACE_EVENT_TYPES 20
+
+typedef struct trace_event
+{
+    uint64_t timestamp_ns;
+    uint32_t thread_id;
+    uint16_t type;
+    uint16_t reserved;
+    int64_t arg1;
+    int32_t arg2;
+    uint32_t padding;
+
+} trace_event;
+
+/*
+ * Binary trace file layout: a trace_file_header followed by 'event_count' trace_events.
+ * Timestamps are CLOCK_MONOTONIC, 'realtime_base_ns' lets traces from different hosts be lined up.
+ */
+typedef struct trace_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t monotonic_base_ns;
+    uint64_t realtime_base_ns;
+    uint64_t event_count;
+    uint64_t dropped;
+    char role[16];
+
+} trace_file_header;
+
+extern int trace_enabled;
+
+#ifdef ENABLE_TRACE
+#define TRACE(type, arg1, arg2) do { if (trace_enabled) trace_record((type), (arg1), (arg2)); } while (0)
+#else
+#define TRACE(type, arg1, arg2) do { (void) (type); (void) (arg1); (void) (arg2); } while (0)
+#endif
+
+
+/**
+  * Enables tracing for 'role', events are dumped to 'path' by trace_finish().
+  */
+void trace_init(const char* role, const char* path);
+
+/**
+  * Appends an event to the calling thread's ring buffer. Use the TRACE() macro instead.
+  */
+void trace_record(int type, int64_t arg1, int arg2);
+
+/**
+  * Writes the events of every thread to the trace file.
+  * Also runs at exit and on SIGINT or SIGTERM once tracing is enabled, only the first call writes the file.
+  */
+void trace_finish(void);
+
+/**
+  * Returns the name of a trace event type.
+  */
+const char* trace_event_name(int type);
+
+#endif
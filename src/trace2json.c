@@ -0,0 +1,172 @@
+#include "header.h"
+#include "trace.h"
+
+/*
+ * Converts binary trace files written with -t into Chrome trace event JSON,
+ * which can be opened in chrome://tracing or https://ui.perfetto.dev
+ *
+ * Usage: trace2json [trace files...] > trace.json
+ * Each file becomes a process in the timeline, timestamps are lined up using the wall clock.
+ */
+
+typedef struct trace_file
+{
+    trace_file_header header;
+    trace_event* events;
+
+} trace_file;
+
+/**
+  * Reads a whole trace file into 'trace'.
+  */
+void read_trace(const char* path, trace_file* trace)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        perror("Failed to open trace file");
+        exit(-1);
+    }
+
+    if (fread(&trace->header, sizeof(trace_file_header), 1, in) != 1
+        || memcmp(trace->header.magic, TRACE_MAGIC, sizeof(trace->header.magic)) != 0)
+    {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        exit(-1);
+    }
+    if (trace->header.version != TRACE_VERSION || trace->header.event_size != sizeof(trace_event))
+    {
+        fprintf(stderr, "%s is a version %u trace file, this trace2json reads version %d\n", path,
+            trace->header.version, TRACE_VERSION);
+        exit(-1);
+    }
+
+    trace->events = calloc(trace->header.event_count, sizeof(trace_event));
+    if (fread(trace->events, sizeof(trace_event), trace->header.event_count, in) != trace->header.event_count)
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        exit(-1);
+    }
+
+    fclose(in);
+}
+
+/**
+  * Returns the wall clock time of 'event' in nanoseconds.
+  */
+uint64_t event_time(trace_file* trace, trace_event* event)
+{
+    return event->timestamp_ns - trace->header.monotonic_base_ns + trace->header.realtime_base_ns;
+}
+
+/**
+  * Name of the second argument of each event type, NULL if unused.
+  */
+const char* arg2_name(int type)
+{
+    switch (type)
+    {
+        case TRACE_PACKET_SEND:
+        case TRACE_PACKET_RECV:
+        case TRACE_REPAIR_SEND:
+        case TRACE_REPAIR_RECV:
+        case TRACE_WRITE_START:
+        case TRACE_WRITE_END:
+        case TRACE_PACKET_CORRUPT:
+        case TRACE_PEER_REPAIR_SEND:
+        case TRACE_PEER_REPAIR_SUPPRESS:
+            return "packet";
+
+        case TRACE_NACK_SEND:
+        case TRACE_NACK_RECV:
+        case TRACE_PEER_REQUEST_SEND:
+        case TRACE_PEER_REQUEST_RECV:
+            return "missing";
+
+        case TRACE_CONTROL_SEND:
+        case TRACE_CONTROL_RECV:
+            return "type";
+
+        default:
+            return NULL;
+    }
+}
+
+void print_event(trace_file* trace, trace_event* event, int pid, uint64_t origin_ns)
+{
+    const char* name = trace_event_name(event->type);
+    const char* phase = "i";
+
+    /* Start and end pairs become duration slices */
+    switch (event->type)
+    {
+        case TRACE_WINDOW_START: name = "window"; phase = "B"; break;
+        case TRACE_WINDOW_END: name = "window"; phase = "E"; break;
+        case TRACE_CHECKSUM_START: name = "checksum"; phase = "B"; break;
+        case TRACE_CHECKSUM_END: name = "checksum"; phase = "E"; break;
+        case TRACE_WRITE_START: name = "write"; phase = "B"; break;
+        case TRACE_WRITE_END: name = "write"; phase = "E"; break;
+    }
+
+    uint64_t ts_ns = event_time(trace, event) - origin_ns;
+    printf(",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%" PRIu64 ".%03" PRIu64 ",\"pid\":%d,\"tid\":%u",
+        name, phase, ts_ns / 1000, ts_ns % 1000, pid, event->thread_id);
+    if (phase[0] == 'i')
+    {
+        printf(",\"s\":\"t\"");
+    }
+
+    printf(",\"args\":{\"window\":%" PRId64, event->arg1);
+    if (arg2_name(event->type) != NULL)
+    {
+        printf(",\"%s\":%d", arg2_name(event->type), event->arg2);
+    }
+    printf("}}");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s [trace files...] > trace.json\n", argv[0]);
+        exit(-1);
+    }
+
+    int num_traces = argc - 1;
+    trace_file* traces = calloc(num_traces, sizeof(trace_file));
+
+    /* Timestamps are printed relative to the earliest event of all files */
+    uint64_t origin_ns = UINT64_MAX;
+    for (int i = 0; i<num_traces; i++)
+    {
+        read_trace(argv[i + 1], &traces[i]);
+        if (traces[i].header.dropped > 0)
+        {
+            fprintf(stderr, "%s: %" PRIu64 " events were overwritten\n", argv[i + 1], traces[i].header.dropped);
+        }
+
+        for (uint64_t j = 0; j<traces[i].header.event_count; j++)
+        {
+            origin_ns = MIN(origin_ns, event_time(&traces[i], &traces[i].events[j]));
+        }
+    }
+
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    printf("{\"name\":\"trace2json\",\"ph\":\"M\",\"pid\":0,\"args\":{}}");
+    for (int i = 0; i<num_traces; i++)
+    {
+        int pid = i + 1;
+        printf(",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s %s\"}}",
+            pid, traces[i].header.role, basename(argv[i + 1]));
+
+        for (uint64_t j = 0; j<traces[i].header.event_count; j++)
+        {
+            print_event(&traces[i], &traces[i].events[j], pid, origin_ns);
+        }
+        free(traces[i].events);
+    }
+    printf("\n]}\n");
+
+    free(traces);
+    return 0;
+}